@@ -18,6 +18,16 @@ static int print_usage()
   printf("test compression: jpge original.png compressed.jpg\n");
   printf("test decompression: jpge -d compressed.jpg uncompressed.tga\n");
   printf("exhaustively test compressor: jpge -x orig.png\n");
+  printf("benchmark compressor (MP/s per input channel count): jpge -b -q90 orig.png\n");
+
+  printf("\noptions:\n");
+  printf("-q#: quality factor 1-100 (default 75)\n");
+  printf("-b: benchmark compression of the source file instead of writing it\n");
+  printf("-f: filter chroma when downsampling (H2V1 and H2V2)\n");
+  printf("-r#: restart interval in MCUs\n");
+  printf("-t#: compress in strips on # threads, in memory (0 = one per core)\n");
+  printf("-p: write a progressive file\n");
+  printf("-k#: find the highest quality that fits in # bytes, in memory\n");
   
   return EXIT_FAILURE;
 }
@@ -239,6 +249,62 @@ failure:
   return status;
 }
 
+static int benchmark_compression(const char *pSrc_filename, const jpge::params &params, int num_threads)
+{
+  int width = 0, height = 0, actual_comps = 0;
+  uint8 *pImage_data = stbi_load(pSrc_filename, &width, &height, &actual_comps, 4);
+  if (!pImage_data)
+  {
+    log_printf("failed loading file \"%s\"!\n", pSrc_filename);
+    return EXIT_FAILURE;
+  }
+
+  const int num_pixels = width * height;
+  int buf_size = num_pixels * 4;
+  if (buf_size < 1024) buf_size = 1024;
+  void *pBuf = malloc(buf_size);
+  uint8 *pSrc_data = (uint8 *)malloc(num_pixels * 4);
+
+  int status = EXIT_SUCCESS;
+  const int num_channels[3] = { 1, 3, 4 };
+  for (int c = 0; c < 3; c++)
+  {
+    const int comps = num_channels[c];
+    for (int i = 0; i < num_pixels; i++)
+      for (int j = 0; j < comps; j++)
+        pSrc_data[i * comps + j] = pImage_data[i * 4 + j];
+
+    uint num_iterations = 0, comp_size = 0;
+    timer tm;
+    tm.start();
+    do
+    {
+      int size = buf_size;
+      const bool success = (num_threads == 1) ? jpge::compress_image_to_jpeg_file_in_memory(pBuf, size, width, height, comps, pSrc_data, params) :
+        jpge::compress_image_to_jpeg_file_in_memory_mt(pBuf, size, width, height, comps, pSrc_data, params, num_threads);
+      if (!success)
+      {
+        log_printf("failed to create jpeg data!!!\n");
+        status = EXIT_FAILURE;
+        goto failure;
+      }
+      comp_size = size;
+      num_iterations++;
+    } while (tm.get_elapsed_secs() < 2.0f);
+    tm.stop();
+
+    const double secs = tm.get_elapsed_secs() / num_iterations;
+    log_printf("%i channel(s): %ix%i, %u bytes, %3.3f ms, %3.2f MP/s\n", comps, width, height, comp_size, secs * 1000.0f, (num_pixels / 1000000.0f) / secs);
+  }
+
+failure:
+  free(pImage_data);
+  free(pSrc_data);
+  free(pBuf);
+
+  return status;
+}
+
 static int test_jpgd(const char *pSrc_filename, const char *pDst_filename)
 {
   
@@ -283,6 +349,13 @@ int main(int arg_c, char* ppArgs[])
   char output_filename[256] = "";
   bool use_jpgd = true;
   bool test_jpgd_decompression = false;
+  bool run_benchmark = false;
+  bool filter_chroma = false;
+  int restart_interval = 0;
+  int num_threads = 1;
+  bool progressive = false;
+  int target_size = 0;
+  int quality_factor = 75;
 
   int arg_index = 1;
   while ((arg_index < arg_c) && (ppArgs[arg_index][0] == '-'))
@@ -298,12 +371,34 @@ int main(int arg_c, char* ppArgs[])
     case 'x':
       run_exhausive_test = true;
       break;
+    case 'b':
+      run_benchmark = true;
+      break;
     case 'm':
       test_memory_compression = true;
       break;
     case 'o':
       optimize_huffman_tables = true;
       break;
+    case 'f':
+      filter_chroma = true;
+      break;
+    case 'r':
+      restart_interval = atoi(&ppArgs[arg_index][2]);
+      break;
+    case 't':
+      num_threads = atoi(&ppArgs[arg_index][2]);
+      break;
+    case 'p':
+      progressive = true;
+      break;
+    case 'q':
+      quality_factor = atoi(&ppArgs[arg_index][2]);
+      break;
+    case 'k':
+      target_size = atoi(&ppArgs[arg_index][2]);
+      test_memory_compression = true;
+      break;
     case 'l':
       if (strcasecmp(&ppArgs[arg_index][1], "luma") == 0)
         subsampling = jpge::Y_ONLY;
@@ -343,6 +438,12 @@ int main(int arg_c, char* ppArgs[])
     arg_index++;
   }
 
+  if ((quality_factor < 1) || (quality_factor > 100))
+  {
+    log_printf("invalid quality factor: %i\n", quality_factor);
+    return EXIT_FAILURE;
+  }
+
   if (run_exhausive_test)
   {
     if ((arg_c - arg_index) < 1)
@@ -354,6 +455,26 @@ int main(int arg_c, char* ppArgs[])
     const char* pSrc_filename = ppArgs[arg_index++];
     return exhausive_compression_test(pSrc_filename, use_jpgd);
   }
+  else if (run_benchmark)
+  {
+    if ((arg_c - arg_index) < 1)
+    {
+      log_printf("not enough parameters (expected source file)\n");
+      return print_usage();
+    }
+
+    jpge::params params;
+    params.m_quality = quality_factor;
+    params.m_subsampling = (subsampling < 0) ? jpge::H2V2 : static_cast<jpge::subsampling_t>(subsampling);
+    params.m_two_pass_flag = optimize_huffman_tables;
+    params.m_max_coefficient_buffer_size = 64 * 1024 * 1024;
+    params.m_filtered_chroma_flag = filter_chroma;
+    params.m_restart_interval = restart_interval;
+    params.m_progressive_flag = progressive;
+
+    const char* pSrc_filename = ppArgs[arg_index++];
+    return benchmark_compression(pSrc_filename, params, num_threads);
+  }
   else if (test_jpgd_decompression)
   {
     if ((arg_c - arg_index) < 2)
@@ -375,11 +496,6 @@ int main(int arg_c, char* ppArgs[])
   const char* pSrc_filename = ppArgs[arg_index++];
   const char* pDst_filename = ppArgs[arg_index++];
 
-  int quality_factor = 75; //---------------->     compression level!!!!!!!   ;
-  if ((quality_factor < 1) || (quality_factor > 100))
-  {
-    return EXIT_FAILURE;
-  }
 
   const int req_comps = 3;
   int width = 0, height = 0, actual_comps = 0;
@@ -396,6 +512,10 @@ int main(int arg_c, char* ppArgs[])
   params.m_quality = quality_factor;
   params.m_subsampling = (subsampling < 0) ? ((actual_comps == 1) ? jpge::Y_ONLY : jpge::H2V2) : static_cast<jpge::subsampling_t>(subsampling);
   params.m_two_pass_flag = optimize_huffman_tables;
+  params.m_max_coefficient_buffer_size = 64 * 1024 * 1024;
+  params.m_filtered_chroma_flag = filter_chroma;
+  params.m_restart_interval = restart_interval;
+  params.m_progressive_flag = progressive;
 
   log_printf("writing jpeg image to file: %s\n", pDst_filename);
 
@@ -404,17 +524,32 @@ int main(int arg_c, char* ppArgs[])
  
   if (test_memory_compression)
   {
-    int buf_size = width * height * 3; 
-    if (buf_size < 1024) buf_size = 1024;
-    void *pBuf = malloc(buf_size);
+    int buf_size = 0;
+    void *pBuf = NULL;
+    int quality = params.m_quality;
+    bool success;
+
+    if (target_size)
+    {
+      buf_size = target_size;
+      pBuf = malloc(buf_size);
+    }
 
     tm.start();
-    if (!jpge::compress_image_to_jpeg_file_in_memory(pBuf, buf_size, width, height, req_comps, pImage_data, params))
+    if (target_size)
+      success = jpge::compress_image_to_jpeg_file_in_memory_target_size(pBuf, buf_size, target_size, width, height, req_comps, pImage_data, params, &quality);
+    else if (num_threads == 1)
+      success = (pBuf = jpge::compress_image_to_jpeg_file_in_memory_alloc(buf_size, jpge::image_desc(pImage_data, width, height, req_comps), params)) != NULL;
+    else
+      success = (pBuf = jpge::compress_image_to_jpeg_file_in_memory_mt_alloc(buf_size, jpge::image_desc(pImage_data, width, height, req_comps), params, num_threads)) != NULL;
+    if (!success)
     {
        log_printf("failed to create jpeg data!!!\n");
        return EXIT_FAILURE;
     }
     tm.stop();
+    if (target_size)
+      log_printf("quality %i fits in %i bytes\n", quality, target_size);
 
     FILE *pFile = fopen(pDst_filename, "wb");
     if (!pFile)
@@ -434,6 +569,8 @@ int main(int arg_c, char* ppArgs[])
        log_printf("failed writing to output file!\n");
        return EXIT_FAILURE;
     }
+
+    free(pBuf);
   }
   else
   {
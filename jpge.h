@@ -9,18 +9,24 @@ namespace jpge
   typedef signed int     int32;
   typedef unsigned short uint16;
   typedef unsigned int   uint32;
+  typedef signed long long   int64;
+  typedef unsigned long long uint64;
   typedef unsigned int   uint;
   
   enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
 
+  // Source pixel layouts. The X byte (alpha or padding) is ignored.
+  enum pixel_format_t { PIXEL_Y = 0, PIXEL_RGB = 1, PIXEL_RGBX = 2, PIXEL_BGR = 3, PIXEL_BGRX = 4 };
+
   struct params
   {
-    inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false) { }
+    inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false), m_max_coefficient_buffer_size(0), m_filtered_chroma_flag(false), m_restart_interval(0), m_restart_in_rows_flag(false), m_progressive_flag(false), m_auto_grayscale_flag(false) { }
 
     inline bool check() const
     {
       if ((m_quality < 1) || (m_quality > 100)) return false;
       if ((uint)m_subsampling > (uint)H2V2) return false;
+      if (m_restart_interval > 0xFFFF) return false;
       return true;
     }
 
@@ -31,18 +37,178 @@ namespace jpge
     bool m_no_chroma_discrim_flag;
 
     bool m_two_pass_flag;
+
+    // With m_two_pass_flag, keep the quantized coefficients in memory during the first pass when they fit in this many bytes (128 per 8x8 block),
+    // so the optimized Huffman tables are built from a single read of the image and get_total_passes() returns 1. Otherwise, or if the buffer
+    // can't be allocated, the scanlines must be supplied twice as usual. 0 disables buffering.
+    uint m_max_coefficient_buffer_size;
+
+    // Downsample chroma with a 1,3,3,1 horizontal filter instead of a plain 2x average. Both are centered between the luma samples; the filter
+    // trades a little chroma sharpness for less aliasing. Only affects H2V1 and H2V2.
+    bool m_filtered_chroma_flag;
+
+    // Number of MCUs (or MCU rows, with m_restart_in_rows_flag) between restart markers. 0 disables restart markers. The interval must fit
+    // in 16 bits, or check() fails, and so must the interval in MCUs, or init() fails.
+    uint m_restart_interval;
+    bool m_restart_in_rows_flag;
+
+    // Write a progressive (SOF2) file using spectral selection and successive approximation, with optimized Huffman tables for every scan.
+    // The whole image's quantized coefficients are kept in memory until the last scanline (128 bytes per 8x8 block, 3 bytes per pixel for
+    // H2V2), and restart markers are not written.
+    bool m_progressive_flag;
+
+    // Have the compress_image_to_jpeg_file*() functions check color input for R == G == B everywhere (scans, X-rays, black and white photos)
+    // and code such images as Y_ONLY: same luma, no chroma planes, roughly half the work and a smaller file. The check reads the pixels once,
+    // stopping at the first colored row. jpeg_encoder itself never sees the whole image and ignores this.
+    bool m_auto_grayscale_flag;
+  };
+
+  // Source pixels read in place: the m_width x m_height rectangle at (m_x, m_y) of an image in m_format whose rows are m_stride bytes apart
+  // (negative for bottom-up images). Crops and padded BGRA surfaces are encoded without an intermediate copy.
+  struct image_desc
+  {
+    inline image_desc() : m_pPixels(0), m_format(PIXEL_RGB), m_stride(0), m_x(0), m_y(0), m_width(0), m_height(0) { }
+    inline image_desc(const void *pPixels, pixel_format_t format, int stride, int x, int y, int width, int height) : m_pPixels(pPixels), m_format(format), m_stride(stride), m_x(x), m_y(y), m_width(width), m_height(height) { }
+
+    // Tightly packed Y, RGB or RGBA pixels, as the num_channels functions below take. Other channel counts give a descriptor check() rejects.
+    image_desc(const void *pPixels, int width, int height, int num_channels);
+
+    bool check() const;
+    const uint8 *get_row(int row) const;
+
+    const void *m_pPixels;
+    pixel_format_t m_format;
+    int m_stride;
+    int m_x, m_y, m_width, m_height;
   };
   
   bool compress_image_to_jpeg_file(const char *pFilename, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params());
+  bool compress_image_to_jpeg_file(const char *pFilename, const image_desc &image, const params &comp_params = params());
+
+  // Like compress_image_to_jpeg_file(), but writes the file through an async_file_stream (see below), so the encoder doesn't wait on a slow
+  // disk. direct_io is passed to async_file_stream::open().
+  bool compress_image_to_jpeg_file_async(const char *pFilename, const image_desc &image, const params &comp_params = params(), bool direct_io = false);
 
   bool compress_image_to_jpeg_file_in_memory(void *pBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params());
+  bool compress_image_to_jpeg_file_in_memory(void *pBuf, int &buf_size, const image_desc &image, const params &comp_params = params());
+
+  // Like compress_image_to_jpeg_file_in_memory(), but encodes horizontal strips of the image on num_threads threads (0 = one per hardware thread).
+  // Strips begin at restart boundaries, so the output always has restart markers: every comp_params.m_restart_interval MCU rows if the interval is
+  // a whole number of rows of at most 65535 MCUs, otherwise every row. The result is byte-identical to a serial encode with that interval,
+  // whatever the thread count. Progressive images are encoded serially. If threads can't be created, the calling thread encodes their strips.
+  bool compress_image_to_jpeg_file_in_memory_mt(void *pBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params(), int num_threads = 0);
+  bool compress_image_to_jpeg_file_in_memory_mt(void *pBuf, int &buf_size, const image_desc &image, const params &comp_params = params(), int num_threads = 0);
+
+  // Compresses a planar YCbCr image, see jpeg_encoder::process_planar_image().
+  bool compress_planar_image_to_jpeg_file_in_memory(void *pBuf, int &buf_size, int width, int height, const uint8 *pY, int y_stride, const uint8 *pCb, int cb_stride, const uint8 *pCr, int cr_stride, const params &comp_params = params());
+
+  // Writes the highest quality file that fits in target_size bytes (and buf_size), ignoring comp_params.m_quality. The image is color converted
+  // and transformed once; each quality tried only requantizes the cached coefficients and predicts the file size from their symbol statistics,
+  // and only the last few are actually coded, to find the real fit. The cache takes 128 bytes per 8x8 block. Returns false if even quality 1
+  // doesn't fit. The quality used is returned in *pQuality if it's not NULL.
+  bool compress_image_to_jpeg_file_in_memory_target_size(void *pBuf, int &buf_size, int target_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params(), int *pQuality = 0);
+  bool compress_image_to_jpeg_file_in_memory_target_size(void *pBuf, int &buf_size, int target_size, const image_desc &image, const params &comp_params = params(), int *pQuality = 0);
     
+  // Returns the largest file the other functions can write for a width x height image with comp_params (0 if they're invalid), so a buffer
+  // of this size never overflows, including the restart markers the _mt functions add. Each block's coefficients are limited by the energy
+  // its pixels can have and stuffed bytes are counted only where the codes leave room for 0xFF, which puts the bound within about 2.5x of
+  // the worst noise found in testing with the standard tables (7x with optimized ones). The _alloc functions need only about the size of
+  // the actual file.
+  uint64 get_compressed_size_bound(int width, int height, const params &comp_params = params());
+
+  // Like compress_image_to_jpeg_file_in_memory() and compress_image_to_jpeg_file_in_memory_mt(), but write into a buffer that grows as needed
+  // and return it (NULL on failure), to be freed with free().
+  uint8 *compress_image_to_jpeg_file_in_memory_alloc(int &buf_size, const image_desc &image, const params &comp_params = params());
+  uint8 *compress_image_to_jpeg_file_in_memory_mt_alloc(int &buf_size, const image_desc &image, const params &comp_params = params(), int num_threads = 0);
+
+  struct progressive_scan;
+  struct strip_set;
+
+  // Receives the encoder's output. The encoder writes bytes inline into a window (its own buffer, or the stream's memory through
+  // get_write_window()) and only calls the stream to hand over or commit a window's worth of data.
   class output_stream
   {
   public:
     virtual ~output_stream() { };
     virtual bool put_buf(const void* Pbuf, int len) = 0;
     template<class T> inline bool put_obj(const T& obj) { return put_buf(&obj, sizeof(T)); }
+
+    // Optional zero-copy interface. A stream that returns a pointer to at least min_len writable bytes of its own memory (avail_len of them)
+    // gets the coded data written there directly, then commit(len) appends the first len bytes. The window is only valid until the next call
+    // on the stream. Returning NULL makes the encoder fall back to put_buf().
+    virtual uint8 *get_write_window(uint min_len, uint &avail_len) { (void)min_len; avail_len = 0; return 0; }
+    virtual bool commit(uint len) { return !len; }
+  };
+
+  // An output_stream handing the output to pFunc (with pUser) piece by piece, for sinks that are neither memory nor a file. pFunc returns
+  // false to fail the encode.
+  class callback_stream : public output_stream
+  {
+  public:
+    typedef bool (*put_buf_func)(const void *pBuf, int len, void *pUser);
+
+    callback_stream(put_buf_func pFunc, void *pUser) : m_pFunc(pFunc), m_pUser(pUser) { }
+    virtual bool put_buf(const void *pBuf, int len) { return m_pFunc(pBuf, len, m_pUser); }
+
+  private:
+    put_buf_func m_pFunc;
+    void *m_pUser;
+  };
+
+  // An output_stream writing to memory that doubles as needed. take_buf() hands the buffer (allocated with malloc()) to the caller and empties
+  // the stream.
+  class growable_memory_stream : public output_stream
+  {
+  public:
+    growable_memory_stream();
+    virtual ~growable_memory_stream();
+
+    virtual bool put_buf(const void* pBuf, int len);
+    virtual uint8 *get_write_window(uint min_len, uint &avail_len);
+    virtual bool commit(uint len);
+
+    const uint8 *get_buf() const { return m_pBuf; }
+    uint get_size() const { return m_buf_ofs; }
+    uint8 *take_buf();
+    // Empties the stream, keeping its buffer.
+    void clear() { m_buf_ofs = 0; }
+
+  private:
+    growable_memory_stream(const growable_memory_stream &);
+    growable_memory_stream &operator =(const growable_memory_stream &);
+    bool reserve(uint len);
+
+    uint8 *m_pBuf;
+    uint m_buf_size, m_buf_ofs;
+  };
+
+  // An output_stream writing a file from a background thread, so the encoder doesn't wait on the disk. Coded data fills buf_size byte buffers
+  // that queue up for the writer, and the encoder only blocks once max_queued_bufs of them are waiting. A file that fits in one buffer is
+  // written by close() without starting the thread. direct_io opens the file with O_DIRECT on Linux (ignored elsewhere, or if the file
+  // system refuses it); buffers are then page aligned. Without JPGE_USE_THREADS full buffers are written synchronously.
+  class async_file_stream : public output_stream
+  {
+  public:
+    async_file_stream();
+    virtual ~async_file_stream();
+
+    bool open(const char *pFilename, bool direct_io = false, uint buf_size = 256 * 1024, uint max_queued_bufs = 4);
+    // Writes whatever is still buffered, waits for the writer and closes the file. Returns false if any write failed.
+    bool close();
+
+    virtual bool put_buf(const void* pBuf, int len);
+    virtual uint8 *get_write_window(uint min_len, uint &avail_len);
+    virtual bool commit(uint len);
+
+  private:
+    async_file_stream(const async_file_stream &);
+    async_file_stream &operator =(const async_file_stream &);
+    bool queue_buf();
+
+    struct writer;
+    writer *m_pWriter;
+    uint8 *m_pBuf;
+    uint m_buf_size, m_buf_ofs;
   };
     
   class jpeg_encoder
@@ -52,53 +218,96 @@ namespace jpge
     ~jpeg_encoder();
 
     bool init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params = params());
+    // process_scanline() then takes rows of width pixels in pixel_format.
+    bool init(output_stream *pStream, int width, int height, pixel_format_t pixel_format, const params &comp_params = params());
     
     const params &get_params() const { return m_params; }
     
     void deinit();
 
-    uint get_total_passes() const { return m_params.m_two_pass_flag ? 2 : 1; }
+    uint get_total_passes() const { return (m_params.m_two_pass_flag && !m_pCoefficient_buffer) ? 2 : 1; }
     inline uint get_cur_pass() { return m_pass_num; }
 
     bool process_scanline(const void* pScanline);
+
+    // Alternative to process_scanline() for input that is already planar YCbCr (full range, as JFIF stores it), such as decoded video frames:
+    // encodes a whole pass of the image, end of image included, with no color conversion or chroma downsampling. The Cb and Cr planes must
+    // be subsampled as m_subsampling says, to (width + 1) / 2 samples for H2V1 and H2V2 and (height + 1) / 2 rows for H2V2, and are ignored
+    // for Y_ONLY. init()'s src_channels doesn't matter. Strides are in bytes and may be negative. Call once per pass.
+    bool process_planar_image(const uint8 *pY, int y_stride, const uint8 *pCb, int cb_stride, const uint8 *pCr, int cr_stride);
         
   private:
     jpeg_encoder(const jpeg_encoder &);
     jpeg_encoder &operator =(const jpeg_encoder &);
 
-    typedef int32 sample_array_t;
+    friend void return_encoder(jpeg_encoder *pEncoder);
+    friend bool compress_image_to_jpeg_file_in_memory_mt(void *pBuf, int &buf_size, const image_desc &image, const params &comp_params, int num_threads);
+    friend uint8 *compress_image_to_jpeg_file_in_memory_mt_alloc(int &buf_size, const image_desc &image, const params &comp_params, int num_threads);
+    friend class mjpeg_encoder;
+    friend uint64 get_compressed_size_bound(int width, int height, const params &comp_params);
+    friend bool compress_image_to_jpeg_file_in_memory_target_size(void *pBuf, int &buf_size, int target_size, const image_desc &image, const params &comp_params, int *pQuality);
+
+    typedef int16 sample_array_t;
+
+    // What code_block() does with each block. It's fixed for a whole pass, so process_mcu_row() picks the row encoder for it once per row:
+    // BLOCK_COUNT gathers pass one statistics, BLOCK_COUNT_AND_BUFFER also keeps the quantized block in m_pCoefficient_buffer, BLOCK_BUFFER
+    // only keeps it (progressive), BLOCK_CACHE_DCT keeps the unquantized DCT output in m_pDCT_cache, and BLOCK_CODE entropy codes it.
+    enum block_mode_t { BLOCK_COUNT, BLOCK_COUNT_AND_BUFFER, BLOCK_BUFFER, BLOCK_CACHE_DCT, BLOCK_CODE, NUM_BLOCK_MODES };
         
     output_stream *m_pStream;
     params m_params;
     uint8 m_num_components;
     uint8 m_comp_h_samp[3], m_comp_v_samp[3];
-    int m_image_x, m_image_y, m_image_bpp, m_image_bpl;
+    int m_image_x, m_image_y;
+    pixel_format_t m_pixel_format;
     int m_image_x_mcu, m_image_y_mcu;
-    int m_image_bpl_xlt, m_image_bpl_mcu;
+    int m_plane_bpl, m_image_bpl_mcu;
     int m_mcus_per_row;
     int m_mcu_x, m_mcu_y;
     uint8 *m_mcu_lines[16];
+    uint m_mcu_lines_size;
     uint8 m_mcu_y_ofs;
     sample_array_t m_sample_array[64];
     int16 m_coefficient_array[64];
     int32 m_quantization_tables[2][64];
+    uint16 m_quantization_recips[2][4][64];
+    int m_cached_quality;
+    bool m_cached_no_chroma_discrim_flag;
     uint m_huff_codes[4][256];
-    uint8 m_huff_code_sizes[4][256];
     uint8 m_huff_bits[4][17];
     uint8 m_huff_val[4][256];
     uint32 m_huff_count[4][256];
+    bool m_std_huff_tables_flag;
     int m_last_dc_val[3];
-    enum { JPGE_OUT_BUF_SIZE = 2048 };
+    uint m_restart_interval;
+    uint m_restart_mcus_left;
+    uint8 m_next_restart_num;
+    int m_blocks_per_mcu;
+    int16 *m_pCoefficient_buffer;
+    uint m_num_buffered_blocks;
+    int16 *m_pDCT_cache;
+    enum { JPGE_OUT_BUF_SIZE = 2048, JPGE_MIN_WINDOW_SIZE = 256 };
     uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
-    uint8 *m_pOut_buf;
+    uint8 *m_pOut_buf, *m_pOut_buf_start;
     uint m_out_buf_left;
-    uint32 m_bit_buffer;
+    uint64 m_bit_buffer;
     uint m_bits_in;
+    enum { MAX_CORRECTION_BITS = 1000 };
+    uint m_eob_run;
+    uint m_num_correction_bits;
+    uint8 m_correction_bits[MAX_CORRECTION_BITS];
     uint8 m_pass_num;
+    uint8 m_header_cache[1024];
+    uint m_header_cache_size, m_header_sof_ofs;
+    int m_header_key[8];
+    bool m_omit_dht_flag;
+    bool m_strip_flag;
+    uint m_strip_first_interval;
     bool m_all_stream_writes_succeeded;
         
     void optimize_huffman_table(int table_num, int table_len);
     void emit_byte(uint8 i);
+    void emit_buf(const uint8 *pBuf, uint len);
     void emit_word(uint i);
     void emit_marker(int marker);
     void emit_jfif_app0();
@@ -106,33 +315,134 @@ namespace jpge
     void emit_sof();
     void emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag);
     void emit_dhts();
-    void emit_sos();
+    void emit_sos(int num_scan_comps, const uint8 *pScan_comps, int ss, int se, int ah, int al);
+    void emit_marker_block(uint8 **ppSof = 0);
     void emit_markers();
-    void compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *bits, uint8 *val);
+    void compute_huffman_table(uint *codes, uint8 *bits, uint8 *val);
     void compute_quant_table(int32 *dst, int16 *src);
+    void compute_quant_recips(uint16 *dst, const int32 *src);
     void adjust_quant_table(int32 *dst, int32 *src);
+    void set_quality(int quality);
+    void set_std_huffman_tables();
     void first_pass_init();
     bool second_pass_init();
-    bool jpg_open(int p_x_res, int p_y_res, int src_channels);
-    void load_block_8_8_grey(int x);
+    uint64 get_coefficient_buffer_size() const;
+    bool jpg_open(int p_x_res, int p_y_res, pixel_format_t pixel_format);
     void load_block_8_8(int x, int y, int c);
     void load_block_16_8(int x, int c);
     void load_block_16_8_8(int x, int c);
-    void load_quantized_coefficients(int component_num);
+    void load_quantized_coefficients(int component_num, const sample_array_t *pSrc);
     void flush_output_buffer();
+    void open_output_window();
     void put_bits(uint bits, uint len);
-    void code_coefficients_pass_one(int component_num);
-    void code_coefficients_pass_two(int component_num);
-    void code_block(int component_num);
-    void process_mcu_row();
+    void flush_bits();
+    void code_coefficients_pass_one(int component_num, bool dc_only = false);
+    void code_coefficients_pass_two(int component_num, bool dc_only = false);
+    template<int pass> void emit_restart();
+    template<int mode> void code_block(int component_num);
+    template<subsampling_t subsampling, int mode, bool planar> void encode_mcu_row();
+    void process_mcu_row(bool planar = false);
+    void code_buffered_coefficients();
+    template<int pass> void code_dct_cache();
+    template<int pass> void put_symbol(int table_num, uint sym);
+    template<int pass> void put_eob_run(int table_num);
+    template<int pass> void code_progressive_block(const int16 *pSrc, int component_num, const progressive_scan &scan);
+    template<int pass> void code_progressive_scan(const progressive_scan &scan);
+    bool code_progressive_scans();
     bool terminate_pass_one();
     bool terminate_pass_two();
     bool process_end_of_image();
     void load_mcu(const void* src);
+    bool init_strip(output_stream *pStream, int width, int height, pixel_format_t pixel_format, const params &comp_params, bool strip_flag, uint first_interval);
+    bool begin_strip_pass_two(const jpeg_encoder &master);
+    static bool encode_strips(strip_set &strips, output_stream *pStream, const image_desc &image, const params &comp_params, int num_threads, bool omit_dht);
+    bool process_image(const image_desc &image);
+    bool init_dct_cache();
+    uint estimate_dct_cache_size(int quality);
+    bool emit_dct_cache(output_stream *pStream, int quality, bool counts_ready);
+    uint64 get_size_bound();
     void clear();
+    void reset();
     void init();
   };
 
+  // Setting up an encoder costs about as much as encoding a small thumbnail, so the compress_image_to_jpeg_file*() functions borrow one
+  // from a per-thread pool of up to four that keep their MCU lines and derived tables between images. Server code can use the pool the same
+  // way. An encoder may be returned on any thread; returning more than the pool holds deletes it. Without JPGE_USE_THREADS these
+  // simply new and delete.
+  jpeg_encoder *borrow_encoder();
+  void return_encoder(jpeg_encoder *pEncoder);
+
+  // Encodes a sequence of frames with the same size, format and params (a camera stream, say) as back to back JPEGs. One encoder is kept for
+  // the whole sequence, so after the first frame none of its buffers, tables or header are rebuilt.
+  class mjpeg_encoder
+  {
+  public:
+    // MJPEG_RAW simply concatenates the frames. MJPEG_MULTIPART writes each as a part of a multipart/x-mixed-replace body delimited by
+    // pBoundary; the HTTP header announcing the boundary is the caller's.
+    enum container_t { MJPEG_RAW = 0, MJPEG_MULTIPART = 1 };
+
+    mjpeg_encoder();
+    ~mjpeg_encoder();
+
+    // omit_dht leaves the Huffman tables out of every frame, as AVI MJPEG does; decoders then assume the standard tables, so it can't be
+    // combined with m_two_pass_flag or m_progressive_flag. With num_threads other than 1 (0 for one per core), encode_frame() codes each
+    // frame in strips on that many threads, as compress_image_to_jpeg_file_in_memory_mt() does. The strip encoders, their buffers and the
+    // threads are likewise kept from frame to frame.
+    bool init(output_stream *pStream, int width, int height, pixel_format_t pixel_format, const params &comp_params = params(), container_t container = MJPEG_RAW, const char *pBoundary = "frame", bool omit_dht = false, int num_threads = 1);
+
+    // Stride is in bytes and may be negative.
+    bool encode_frame(const void *pPixels, int stride);
+    // Planar YCbCr frames, laid out as jpeg_encoder::process_planar_image() describes.
+    bool encode_planar_frame(const uint8 *pY, int y_stride, const uint8 *pCb, int cb_stride, const uint8 *pCr, int cr_stride);
+
+    // Ends the sequence, writing the closing boundary of a multipart body. init() starts a new one.
+    bool finish();
+
+    uint get_num_frames() const { return m_num_frames; }
+
+  private:
+    mjpeg_encoder(const mjpeg_encoder &);
+    mjpeg_encoder &operator =(const mjpeg_encoder &);
+    bool begin_frame(bool init_encoder);
+    bool end_frame(bool status);
+
+    // Passes a frame's data on to the caller's stream, preceded by the part header once there is some. A frame that fails before writing
+    // anything (when init() can't allocate its buffers, say) leaves no empty part behind.
+    class part_stream : public output_stream
+    {
+    public:
+      virtual bool put_buf(const void *pBuf, int len);
+      virtual uint8 *get_write_window(uint min_len, uint &avail_len);
+      virtual bool commit(uint len);
+      bool put_header();
+
+      output_stream *m_pStream;
+      const char *m_pHeader;
+      uint m_header_len;
+    };
+
+    jpeg_encoder m_encoder;
+    part_stream m_part_stream;
+    output_stream *m_pStream;
+    int m_width, m_height;
+    pixel_format_t m_pixel_format;
+    params m_params;
+    char m_part_header[2 + 70 + 2 + 26 + 2 + 1];
+    uint m_part_header_len;
+    uint m_num_frames;
+    int m_num_threads;
+    strip_set *m_pStrip_set;
+  };
+
+  enum { JPGE_MAX_PYRAMID_LEVELS = 16 };
+
+  // Writes image to ppStreams[0] and num_levels - 1 successively halved versions of it to the streams that follow, each 2x2 box filtered from
+  // the level above (an odd last row or column is averaged with itself, so a w x h level gives (w + 1) / 2 x (h + 1) / 2). The source is read
+  // once and every level is encoded as its rows become available, with comp_params for all of them. With m_two_pass_flag and no coefficient
+  // buffer the source is read twice.
+  bool compress_image_pyramid(output_stream *const *ppStreams, int num_levels, const image_desc &image, const params &comp_params = params());
+
 }
 
 #endif
@@ -2,16 +2,69 @@
 #include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
+#include <math.h>
 
 #define JPGE_MAX(a,b) (((a)>(b))?(a):(b))
 #define JPGE_MIN(a,b) (((a)<(b))?(a):(b))
 
+// Set JPGE_USE_SSE2/JPGE_USE_AVX2 to 0 to force the plain C paths. AVX2 kernels are compiled for their own target and only used if the CPU reports AVX2 at runtime.
+#ifndef JPGE_USE_SSE2
+  #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+    #define JPGE_USE_SSE2 1
+  #else
+    #define JPGE_USE_SSE2 0
+  #endif
+#endif
+
+#ifndef JPGE_USE_AVX2
+  #if JPGE_USE_SSE2 && ((defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))) || defined(__clang__) || (defined(_MSC_VER) && (_MSC_VER >= 1700)))
+    #define JPGE_USE_AVX2 1
+  #else
+    #define JPGE_USE_AVX2 0
+  #endif
+#endif
+
+// Set JPGE_USE_THREADS to 0 to build without <thread>; compress_image_to_jpeg_file_in_memory_mt() then encodes its strips one after another.
+#ifndef JPGE_USE_THREADS
+  #define JPGE_USE_THREADS 1
+#endif
+
+#if JPGE_USE_SSE2
+  #include <emmintrin.h>
+#endif
+
+#if JPGE_USE_THREADS
+  #include <thread>
+  #include <mutex>
+  #include <condition_variable>
+  #include <system_error>
+#endif
+
+#if defined(__linux__)
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+  #include <intrin.h>
+#endif
+
+#if JPGE_USE_AVX2
+  #include <immintrin.h>
+  #if defined(_MSC_VER) && !defined(__clang__)
+    #define JPGE_AVX2_FUNC
+  #else
+    #define JPGE_AVX2_FUNC __attribute__((target("avx2")))
+  #endif
+#endif
+
 namespace jpge {
 
 static inline void *jpge_malloc(size_t nSize) { return malloc(nSize); }
+static inline void *jpge_realloc(void *p, size_t nSize) { return realloc(p, nSize); }
 static inline void jpge_free(void *p) { free(p); }
 
-enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_APP0 = 0xE0 };
+enum { M_SOF0 = 0xC0, M_SOF2 = 0xC2, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_RST0 = 0xD0, M_APP0 = 0xE0 };
 enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
 
 static uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
@@ -42,48 +95,227 @@ static uint8 s_ac_chroma_val[AC_CHROMA_CODES] =
   0xf9,0xfa
 };
 
+// The component of each block of an MCU, indexed by subsampling.
+static const uint8 s_mcu_components[4][6] = { { 0 }, { 0, 1, 2 }, { 0, 0, 1, 2 }, { 0, 0, 0, 0, 1, 2 } };
+
 template <class T> inline void clear_obj(T &obj) { memset(&obj, 0, sizeof(obj)); }
 
 const int YR = 19595, YG = 38470, YB = 7471, CB_R = -11059, CB_G = -21709, CB_B = 32768, CR_R = 32768, CR_G = -27439, CR_B = -5329;
 static inline uint8 clamp(int i) { if (static_cast<uint>(i) > 255U) { if (i < 0) i = 0; else if (i > 255) i = 255; } return static_cast<uint8>(i); }
 
-static void RGB_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels)
+#if JPGE_USE_SSE2
+// The SIMD converters rely on YR+YG+YB == 65536 and CB_R+CB_G+CB_B == CR_R+CR_G+CR_B == 0, which lets every product be taken on channel differences that fit in 16 bits:
+// Y = g + (((r-g)*YR + (b-g)*YB + 32768) >> 16), Cb = 128 + (((r-b)*CB_R + (g-b)*CB_G + 32768) >> 16), Cr = 128 + (((g-r)*CR_G + (b-r)*CR_B + 32768) >> 16).
+// These are exactly the scalar results. Kernels write planar Y, Cb and Cr rows plane_bpl bytes apart and return the number of pixels they converted,
+// leaving the tail to the scalar loops; they may read a few bytes past their last source pixel, so they always stop at least two pixels short of the end of the row.
+
+// Packs two 16-bit multipliers into one 32-bit lane for _mm_madd_epi16(): lo applies to the first operand of each pair, hi to the second.
+static inline int pack_coeffs(int lo, int hi) { return static_cast<int>((static_cast<uint>(hi) << 16) | (static_cast<uint>(lo) & 0xFFFFU)); }
+
+static inline __m128i sse2_mul_pairs(__m128i a, __m128i b, __m128i coeffs)
+{
+  const __m128i k = _mm_set1_epi32(32768);
+  __m128i lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), coeffs), k), 16);
+  __m128i hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), coeffs), k), 16);
+  return _mm_packs_epi32(lo, hi);
+}
+
+// 8 pixels of planar 16-bit r, g, b -> 16-bit y, cb, cr.
+static inline void sse2_rgb_to_ycc_8(__m128i r, __m128i g, __m128i b, __m128i &y, __m128i &cb, __m128i &cr)
+{
+  const __m128i k128 = _mm_set1_epi16(128);
+  y  = _mm_add_epi16(g, sse2_mul_pairs(_mm_sub_epi16(r, g), _mm_sub_epi16(b, g), _mm_set1_epi32(pack_coeffs(YR, YB))));
+  cb = _mm_add_epi16(k128, sse2_mul_pairs(_mm_sub_epi16(r, b), _mm_sub_epi16(g, b), _mm_set1_epi32(pack_coeffs(CB_R, CB_G))));
+  cr = _mm_add_epi16(k128, sse2_mul_pairs(_mm_sub_epi16(g, r), _mm_sub_epi16(b, r), _mm_set1_epi32(pack_coeffs(CR_G, CR_B))));
+}
+
+static inline __m128i sse2_y_only_8(__m128i r, __m128i g, __m128i b)
+{
+  return _mm_add_epi16(g, sse2_mul_pairs(_mm_sub_epi16(r, g), _mm_sub_epi16(b, g), _mm_set1_epi32(pack_coeffs(YR, YB))));
+}
+
+// Loads 4 pixels into 32-bit RGBx lanes.
+template<int num_channels> static inline __m128i sse2_load_4(const uint8 *pSrc)
+{
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+  if (num_channels == 4)
+    return v;
+  __m128i a = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+  __m128i b = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+  return _mm_unpacklo_epi64(a, b);
+}
+
+// Deinterleaves 8 pixels into planar 16-bit r, g, b.
+template<int num_channels> static inline void sse2_load_8(const uint8 *pSrc, __m128i &r, __m128i &g, __m128i &b)
+{
+  const __m128i m = _mm_set1_epi32(0xFF);
+  __m128i p0 = sse2_load_4<num_channels>(pSrc), p1 = sse2_load_4<num_channels>(pSrc + 4 * num_channels);
+  r = _mm_packs_epi32(_mm_and_si128(p0, m), _mm_and_si128(p1, m));
+  g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), m), _mm_and_si128(_mm_srli_epi32(p1, 8), m));
+  b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), m), _mm_and_si128(_mm_srli_epi32(p1, 16), m));
+}
+
+template<int num_channels, bool bgr, bool luma_only> static int sse2_convert(uint8* pDst, int plane_bpl, const uint8 *pSrc, int num_pixels)
+{
+  int n = 0;
+  for ( ; num_pixels - n >= 16 + 2; n += 16)
+  {
+    const uint8 *s = pSrc + n * num_channels;
+    __m128i y[2], cb[2], cr[2];
+    for (int h = 0; h < 2; h++)
+    {
+      __m128i r, g, b;
+      if (bgr)
+        sse2_load_8<num_channels>(s + h * 8 * num_channels, b, g, r);
+      else
+        sse2_load_8<num_channels>(s + h * 8 * num_channels, r, g, b);
+      if (luma_only)
+        y[h] = sse2_y_only_8(r, g, b);
+      else
+        sse2_rgb_to_ycc_8(r, g, b, y[h], cb[h], cr[h]);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + n), _mm_packus_epi16(y[0], y[1]));
+    if (!luma_only)
+    {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + plane_bpl + n), _mm_packus_epi16(cb[0], cb[1]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + plane_bpl * 2 + n), _mm_packus_epi16(cr[0], cr[1]));
+    }
+  }
+  return n;
+}
+#endif
+
+#if JPGE_USE_AVX2
+static bool avx2_supported()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  int regs[4];
+  __cpuid(regs, 0);
+  if (regs[0] < 7) return false;
+  __cpuid(regs, 1);
+  const bool osxsave = (regs[2] & (1 << 27)) != 0, avx = (regs[2] & (1 << 28)) != 0;
+  if (!osxsave || !avx || ((_xgetbv(0) & 6) != 6)) return false;
+  __cpuidex(regs, 7, 0);
+  return (regs[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static const bool g_avx2_supported = avx2_supported();
+
+JPGE_AVX2_FUNC static inline __m256i avx2_mul_pairs(__m256i a, __m256i b, __m256i coeffs)
+{
+  const __m256i k = _mm256_set1_epi32(32768);
+  __m256i lo = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), coeffs), k), 16);
+  __m256i hi = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), coeffs), k), 16);
+  return _mm256_packs_epi32(lo, hi);
+}
+
+// Deinterleaves 16 pixels into 16-bit r, g, b. The packs leave pixels in 4-pixel groups ordered 0,2,1,3 across the two lanes; avx2_unpermute() undoes that after the final byte pack.
+template<int num_channels> JPGE_AVX2_FUNC static inline void avx2_load_16(const uint8 *pSrc, __m256i &r, __m256i &g, __m256i &b)
+{
+  const __m256i m = _mm256_set1_epi32(0xFF);
+  __m256i p[2];
+  for (int i = 0; i < 2; i++)
+  {
+    const uint8 *s = pSrc + i * 8 * num_channels;
+    if (num_channels == 4)
+      p[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+    else
+    {
+      const __m256i expand = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+      __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s))), _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 12)), 1);
+      p[i] = _mm256_shuffle_epi8(v, expand);
+    }
+  }
+  r = _mm256_packs_epi32(_mm256_and_si256(p[0], m), _mm256_and_si256(p[1], m));
+  g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p[0], 8), m), _mm256_and_si256(_mm256_srli_epi32(p[1], 8), m));
+  b = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p[0], 16), m), _mm256_and_si256(_mm256_srli_epi32(p[1], 16), m));
+}
+
+JPGE_AVX2_FUNC static inline __m256i avx2_unpermute(__m256i v)
+{
+  return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+template<int num_channels, bool bgr, bool luma_only> JPGE_AVX2_FUNC static int avx2_convert(uint8* pDst, int plane_bpl, const uint8 *pSrc, int num_pixels)
 {
-  for ( ; num_pixels; pDst += 3, pSrc += 3, num_pixels--)
+  const __m256i k128 = _mm256_set1_epi16(128);
+  const __m256i y_coeffs = _mm256_set1_epi32(pack_coeffs(YR, YB)), cb_coeffs = _mm256_set1_epi32(pack_coeffs(CB_R, CB_G)), cr_coeffs = _mm256_set1_epi32(pack_coeffs(CR_G, CR_B));
+  int n = 0;
+  for ( ; num_pixels - n >= 32 + 2; n += 32)
   {
-    const int r = pSrc[0], g = pSrc[1], b = pSrc[2];
-    pDst[0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
-    pDst[1] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
-    pDst[2] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
+    const uint8 *s = pSrc + n * num_channels;
+    __m256i y[2], cb[2], cr[2];
+    for (int h = 0; h < 2; h++)
+    {
+      __m256i r, g, b;
+      if (bgr)
+        avx2_load_16<num_channels>(s + h * 16 * num_channels, b, g, r);
+      else
+        avx2_load_16<num_channels>(s + h * 16 * num_channels, r, g, b);
+      y[h] = _mm256_add_epi16(g, avx2_mul_pairs(_mm256_sub_epi16(r, g), _mm256_sub_epi16(b, g), y_coeffs));
+      if (!luma_only)
+      {
+        cb[h] = _mm256_add_epi16(k128, avx2_mul_pairs(_mm256_sub_epi16(r, b), _mm256_sub_epi16(g, b), cb_coeffs));
+        cr[h] = _mm256_add_epi16(k128, avx2_mul_pairs(_mm256_sub_epi16(g, r), _mm256_sub_epi16(b, r), cr_coeffs));
+      }
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + n), avx2_unpermute(_mm256_packus_epi16(y[0], y[1])));
+    if (!luma_only)
+    {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + plane_bpl + n), avx2_unpermute(_mm256_packus_epi16(cb[0], cb[1])));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + plane_bpl * 2 + n), avx2_unpermute(_mm256_packus_epi16(cr[0], cr[1])));
+    }
   }
+  return n;
 }
+#endif
 
-static void RGB_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels)
+template<int num_channels, bool bgr, bool luma_only> static inline int simd_convert(uint8* pDst, int plane_bpl, const uint8 *pSrc, int num_pixels)
 {
-  for ( ; num_pixels; pDst++, pSrc += 3, num_pixels--)
-    pDst[0] = static_cast<uint8>((pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) >> 16);
+#if JPGE_USE_AVX2
+  if (g_avx2_supported)
+    return avx2_convert<num_channels, bgr, luma_only>(pDst, plane_bpl, pSrc, num_pixels);
+#endif
+#if JPGE_USE_SSE2
+  return sse2_convert<num_channels, bgr, luma_only>(pDst, plane_bpl, pSrc, num_pixels);
+#else
+  (void)pDst; (void)plane_bpl; (void)pSrc; (void)num_pixels;
+  return 0;
+#endif
 }
 
-static void RGBA_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels)
+// The YCC converters write one row of each plane: Y at pDst, Cb at pDst + plane_bpl, Cr at pDst + plane_bpl * 2. Pixels are num_channels
+// bytes, red first (or blue first with bgr); any fourth byte is ignored.
+template<int num_channels, bool bgr> static void RGB_to_YCC(uint8* pDst, int plane_bpl, const uint8 *pSrc, int num_pixels)
 {
-  for ( ; num_pixels; pDst += 3, pSrc += 4, num_pixels--)
+  const int n = simd_convert<num_channels, bgr, false>(pDst, plane_bpl, pSrc, num_pixels);
+  pSrc += n * num_channels;
+  for (int i = n; i < num_pixels; i++, pSrc += num_channels)
   {
-    const int r = pSrc[0], g = pSrc[1], b = pSrc[2];
-    pDst[0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
-    pDst[1] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
-    pDst[2] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
+    const int r = pSrc[bgr ? 2 : 0], g = pSrc[1], b = pSrc[bgr ? 0 : 2];
+    pDst[i] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
+    pDst[plane_bpl + i] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
+    pDst[plane_bpl * 2 + i] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
   }
 }
 
-static void RGBA_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels)
+template<int num_channels, bool bgr> static void RGB_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels)
 {
-  for ( ; num_pixels; pDst++, pSrc += 4, num_pixels--)
-    pDst[0] = static_cast<uint8>((pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) >> 16);
+  const int n = simd_convert<num_channels, bgr, true>(pDst, 0, pSrc, num_pixels);
+  pDst += n; pSrc += n * num_channels; num_pixels -= n;
+  for ( ; num_pixels; pDst++, pSrc += num_channels, num_pixels--)
+    pDst[0] = static_cast<uint8>((pSrc[bgr ? 2 : 0] * YR + pSrc[1] * YG + pSrc[bgr ? 0 : 2] * YB + 32768) >> 16);
 }
 
-static void Y_to_YCC(uint8* pDst, const uint8* pSrc, int num_pixels)
+static void Y_to_YCC(uint8* pDst, int plane_bpl, const uint8* pSrc, int num_pixels)
 {
-  for( ; num_pixels; pDst += 3, pSrc++, num_pixels--) { pDst[0] = pSrc[0]; pDst[1] = 128; pDst[2] = 128; }
+  memcpy(pDst, pSrc, num_pixels);
+  memset(pDst + plane_bpl, 128, num_pixels);
+  memset(pDst + plane_bpl * 2, 128, num_pixels);
 }
 
 enum { CONST_BITS = 13, ROW_BITS = 2 };
@@ -105,9 +337,79 @@ enum { CONST_BITS = 13, ROW_BITS = 2 };
   u3 += z5; u4 += z5; \
   s0 = t10 + t11; s1 = t7 + u1 + u4; s3 = t6 + u2 + u3; s4 = t10 - t11; s5 = t5 + u2 + u4; s7 = t4 + u1 + u3;
 
-static void DCT2D(int32 *p)
+#if JPGE_USE_SSE2
+// 16-bit SSE2 version of DCT2D: each register holds one row (or, after a transpose, one column position) of 8 samples.
+// DCT_MUL truncates its operand to 16 bits, so doing the sums that feed it in wrapping 16-bit lanes changes nothing, and every product is taken
+// with _mm_madd_epi16 into 32 bits before descaling. With 8-bit input the row pass outputs stay within +-4096 and the remaining 16-bit sums within
+// +-32768, so the result matches the 32-bit DCT2D bit for bit.
+
+// ((a * ca + b * cb + c * cc + d * cd) + rounding) >> n, per lane, in 32 bits.
+static inline __m128i sse2_dct_madd(__m128i a, __m128i b, int ca, int cb, __m128i c, __m128i d, int cc, int cd, int n)
+{
+  const __m128i k0 = _mm_set1_epi32(pack_coeffs(ca, cb)), k1 = _mm_set1_epi32(pack_coeffs(cc, cd)), round = _mm_set1_epi32(1 << (n - 1));
+  __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), k0), _mm_madd_epi16(_mm_unpacklo_epi16(c, d), k1));
+  __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), k0), _mm_madd_epi16(_mm_unpackhi_epi16(c, d), k1));
+  return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, round), n), _mm_srai_epi32(_mm_add_epi32(hi, round), n));
+}
+
+template<bool row_pass> static inline void sse2_dct_1d(__m128i *s)
+{
+  const __m128i z = _mm_setzero_si128();
+  const int odd_shift = row_pass ? (CONST_BITS-ROW_BITS) : (CONST_BITS+ROW_BITS+3);
+  __m128i t0 = _mm_add_epi16(s[0], s[7]), t7 = _mm_sub_epi16(s[0], s[7]), t1 = _mm_add_epi16(s[1], s[6]), t6 = _mm_sub_epi16(s[1], s[6]);
+  __m128i t2 = _mm_add_epi16(s[2], s[5]), t5 = _mm_sub_epi16(s[2], s[5]), t3 = _mm_add_epi16(s[3], s[4]), t4 = _mm_sub_epi16(s[3], s[4]);
+  __m128i t10 = _mm_add_epi16(t0, t3), t13 = _mm_sub_epi16(t0, t3), t11 = _mm_add_epi16(t1, t2), t12 = _mm_sub_epi16(t1, t2);
+  if (row_pass)
+  {
+    s[0] = _mm_slli_epi16(_mm_add_epi16(t10, t11), ROW_BITS);
+    s[4] = _mm_slli_epi16(_mm_sub_epi16(t10, t11), ROW_BITS);
+  }
+  else
+  {
+    s[0] = sse2_dct_madd(t10, t11, 1, 1, z, z, 0, 0, ROW_BITS+3);
+    s[4] = sse2_dct_madd(t10, t11, 1, -1, z, z, 0, 0, ROW_BITS+3);
+  }
+  const __m128i t12_13 = _mm_add_epi16(t12, t13);
+  s[2] = sse2_dct_madd(t12_13, t13, 4433, 6270, z, z, 0, 0, odd_shift);
+  s[6] = sse2_dct_madd(t12_13, t12, 4433, -15137, z, z, 0, 0, odd_shift);
+  const __m128i u1 = _mm_add_epi16(t4, t7), u2 = _mm_add_epi16(t5, t6), u3 = _mm_add_epi16(t4, t6), u4 = _mm_add_epi16(t5, t7), z5 = _mm_add_epi16(u3, u4);
+  s[1] = sse2_dct_madd(t7, u1, 12299, -7373, u4, z5, -3196, 9633, odd_shift);
+  s[3] = sse2_dct_madd(t6, u2, 25172, -20995, u3, z5, -16069, 9633, odd_shift);
+  s[5] = sse2_dct_madd(t5, u2, 16819, -20995, u4, z5, -3196, 9633, odd_shift);
+  s[7] = sse2_dct_madd(t4, u1, 2446, -7373, u3, z5, -16069, 9633, odd_shift);
+}
+
+static inline void sse2_transpose_8x8_epi16(__m128i *v)
+{
+  __m128i a0 = _mm_unpacklo_epi16(v[0], v[1]), a1 = _mm_unpackhi_epi16(v[0], v[1]), a2 = _mm_unpacklo_epi16(v[2], v[3]), a3 = _mm_unpackhi_epi16(v[2], v[3]);
+  __m128i a4 = _mm_unpacklo_epi16(v[4], v[5]), a5 = _mm_unpackhi_epi16(v[4], v[5]), a6 = _mm_unpacklo_epi16(v[6], v[7]), a7 = _mm_unpackhi_epi16(v[6], v[7]);
+  __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2), b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+  __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6), b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+  v[0] = _mm_unpacklo_epi64(b0, b4); v[1] = _mm_unpackhi_epi64(b0, b4); v[2] = _mm_unpacklo_epi64(b1, b5); v[3] = _mm_unpackhi_epi64(b1, b5);
+  v[4] = _mm_unpacklo_epi64(b2, b6); v[5] = _mm_unpackhi_epi64(b2, b6); v[6] = _mm_unpacklo_epi64(b3, b7); v[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+static void sse2_DCT2D(int16 *p)
+{
+  __m128i s[8];
+  for (int i = 0; i < 8; i++) s[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i * 8));
+  sse2_transpose_8x8_epi16(s);
+  sse2_dct_1d<true>(s);
+  sse2_transpose_8x8_epi16(s);
+  sse2_dct_1d<false>(s);
+  for (int i = 0; i < 8; i++) _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i * 8), s[i]);
+}
+#endif
+
+// Transforms a block of level-shifted 8-bit samples in place. Without SSE2 the block is widened and run through the 32-bit DCT1D.
+static void DCT2D(int16 *p)
 {
-  int32 c, *q = p;
+#if JPGE_USE_SSE2
+  sse2_DCT2D(p);
+#else
+  int32 block[64];
+  for (int i = 0; i < 64; i++) block[i] = p[i];
+  int32 c, *q = block;
   for (c = 7; c >= 0; c--, q += 8)
   {
     int32 s0 = q[0], s1 = q[1], s2 = q[2], s3 = q[3], s4 = q[4], s5 = q[5], s6 = q[6], s7 = q[7];
@@ -115,13 +417,90 @@ static void DCT2D(int32 *p)
     q[0] = s0 << ROW_BITS; q[1] = DCT_DESCALE(s1, CONST_BITS-ROW_BITS); q[2] = DCT_DESCALE(s2, CONST_BITS-ROW_BITS); q[3] = DCT_DESCALE(s3, CONST_BITS-ROW_BITS);
     q[4] = s4 << ROW_BITS; q[5] = DCT_DESCALE(s5, CONST_BITS-ROW_BITS); q[6] = DCT_DESCALE(s6, CONST_BITS-ROW_BITS); q[7] = DCT_DESCALE(s7, CONST_BITS-ROW_BITS);
   }
-  for (q = p, c = 7; c >= 0; c--, q++)
+  for (q = block, c = 7; c >= 0; c--, q++)
   {
     int32 s0 = q[0*8], s1 = q[1*8], s2 = q[2*8], s3 = q[3*8], s4 = q[4*8], s5 = q[5*8], s6 = q[6*8], s7 = q[7*8];
     DCT1D(s0, s1, s2, s3, s4, s5, s6, s7);
     q[0*8] = DCT_DESCALE(s0, ROW_BITS+3); q[1*8] = DCT_DESCALE(s1, CONST_BITS+ROW_BITS+3); q[2*8] = DCT_DESCALE(s2, CONST_BITS+ROW_BITS+3); q[3*8] = DCT_DESCALE(s3, CONST_BITS+ROW_BITS+3);
     q[4*8] = DCT_DESCALE(s4, ROW_BITS+3); q[5*8] = DCT_DESCALE(s5, CONST_BITS+ROW_BITS+3); q[6*8] = DCT_DESCALE(s6, CONST_BITS+ROW_BITS+3); q[7*8] = DCT_DESCALE(s7, CONST_BITS+ROW_BITS+3);
   }
+  for (int i = 0; i < 64; i++) p[i] = static_cast<int16>(block[i]);
+#endif
+}
+
+// Quantization multiplies by reciprocals instead of dividing. Each table holds, per coefficient in natural (not zig-zag) order, a 16-bit
+// reciprocal, a rounding correction, a scale that stands in for a per-coefficient right shift, and a keep mask used only when the divisor is 1:
+// t = |x| + correction, p = (t * reciprocal) >> 16, |x'| = ((p * scale) >> 16) | (p & keep).
+// For |x| <= 32768 and divisors 1..255 this equals (|x| + q/2) / q exactly (checked exhaustively), matching the old division-based rounding.
+enum { QUANT_RECIP = 0, QUANT_CORR, QUANT_SCALE, QUANT_KEEP };
+
+static inline int16 quantize_coeff(int32 x, uint recip, uint corr, uint scale, uint keep)
+{
+  const uint t = static_cast<uint>(x < 0 ? -x : x) + corr;
+  const uint p = (t * recip) >> 16;
+  const int32 q = static_cast<int32>(((p * scale) >> 16) | (p & keep));
+  return static_cast<int16>(x < 0 ? -q : q);
+}
+
+#if JPGE_USE_SSE2
+static void sse2_quantize_block(int16 *pDst, const int16 *pSrc, const uint16 *pRecips)
+{
+  for (int i = 0; i < 64; i += 8)
+  {
+    const __m128i *r = reinterpret_cast<const __m128i*>(pRecips + i);
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i));
+    __m128i sign = _mm_srai_epi16(x, 15);
+    __m128i t = _mm_add_epi16(_mm_sub_epi16(_mm_xor_si128(x, sign), sign), _mm_loadu_si128(r + QUANT_CORR * 8));
+    __m128i p = _mm_mulhi_epu16(t, _mm_loadu_si128(r + QUANT_RECIP * 8));
+    __m128i q = _mm_or_si128(_mm_mulhi_epu16(p, _mm_loadu_si128(r + QUANT_SCALE * 8)), _mm_and_si128(p, _mm_loadu_si128(r + QUANT_KEEP * 8)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + i), _mm_sub_epi16(_mm_xor_si128(q, sign), sign));
+  }
+}
+#endif
+
+#if JPGE_USE_AVX2
+JPGE_AVX2_FUNC static void avx2_quantize_block(int16 *pDst, const int16 *pSrc, const uint16 *pRecips)
+{
+  for (int i = 0; i < 64; i += 16)
+  {
+    const __m256i *r = reinterpret_cast<const __m256i*>(pRecips + i);
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSrc + i));
+    __m256i sign = _mm256_srai_epi16(x, 15);
+    __m256i t = _mm256_add_epi16(_mm256_sub_epi16(_mm256_xor_si256(x, sign), sign), _mm256_loadu_si256(r + QUANT_CORR * 4));
+    __m256i p = _mm256_mulhi_epu16(t, _mm256_loadu_si256(r + QUANT_RECIP * 4));
+    __m256i q = _mm256_or_si256(_mm256_mulhi_epu16(p, _mm256_loadu_si256(r + QUANT_SCALE * 4)), _mm256_and_si256(p, _mm256_loadu_si256(r + QUANT_KEEP * 4)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + i), _mm256_sub_epi16(_mm256_xor_si256(q, sign), sign));
+  }
+}
+#endif
+
+static void quantize_block(int16 *pDst, const int16 *pSrc, const uint16 *pRecips)
+{
+#if JPGE_USE_AVX2
+  if (g_avx2_supported) { avx2_quantize_block(pDst, pSrc, pRecips); return; }
+#endif
+#if JPGE_USE_SSE2
+  sse2_quantize_block(pDst, pSrc, pRecips);
+#else
+  for (int i = 0; i < 64; i++)
+    pDst[i] = quantize_coeff(pSrc[i], pRecips[QUANT_RECIP * 64 + i], pRecips[QUANT_CORR * 64 + i], pRecips[QUANT_SCALE * 64 + i], pRecips[QUANT_KEEP * 64 + i]);
+#endif
+}
+
+static inline bool is_flat_block(const int16 *p)
+{
+#if JPGE_USE_SSE2
+  const __m128i first = _mm_set1_epi16(p[0]);
+  __m128i diff = _mm_setzero_si128();
+  for (int i = 0; i < 64; i += 8)
+    diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), first));
+  return _mm_movemask_epi8(_mm_cmpeq_epi16(diff, _mm_setzero_si128())) == 0xFFFF;
+#else
+  int diff = 0;
+  for (int i = 1; i < 64; i++)
+    diff |= p[i] ^ p[0];
+  return diff == 0;
+#endif
 }
 
 struct sym_freq { uint m_key, m_sym_index; };
@@ -189,6 +568,7 @@ static void huffman_enforce_max_code_size(int *pNum_codes, int code_list_len, in
 
 void jpeg_encoder::optimize_huffman_table(int table_num, int table_len)
 {
+  m_std_huff_tables_flag = false;
   sym_freq syms0[MAX_HUFF_SYMBOLS], syms1[MAX_HUFF_SYMBOLS];
   syms0[0].m_key = 1; syms0[0].m_sym_index = 0; 
   int num_used_syms = 1;
@@ -218,9 +598,24 @@ void jpeg_encoder::optimize_huffman_table(int table_num, int table_len)
     m_huff_val[table_num][num_used_syms - 1 - i] = static_cast<uint8>(pSyms[i].m_sym_index - 1);
 }
 
+#define JPGE_PUT_BYTE(c) { if (!m_out_buf_left) open_output_window(); *m_pOut_buf++ = (c); m_out_buf_left--; }
+
 void jpeg_encoder::emit_byte(uint8 i)
 {
-  m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_obj(i);
+  JPGE_PUT_BYTE(i);
+}
+
+// Copies runs of header bytes into the output window whole.
+void jpeg_encoder::emit_buf(const uint8 *pBuf, uint len)
+{
+  while (len)
+  {
+    if (!m_out_buf_left) open_output_window();
+    const uint n = JPGE_MIN(len, m_out_buf_left);
+    memcpy(m_pOut_buf, pBuf, n);
+    m_pOut_buf += n; m_out_buf_left -= n;
+    pBuf += n; len -= n;
+  }
 }
 
 void jpeg_encoder::emit_word(uint i)
@@ -235,34 +630,31 @@ void jpeg_encoder::emit_marker(int marker)
 
 void jpeg_encoder::emit_jfif_app0()
 {
-  emit_marker(M_APP0);
-  emit_word(2 + 4 + 1 + 2 + 1 + 2 + 2 + 1 + 1);
-  emit_byte(0x4A); emit_byte(0x46); emit_byte(0x49); emit_byte(0x46); /* Identifier: ASCII "JFIF" */
-  emit_byte(0);
-  emit_byte(1);     
-  emit_byte(1);      
-  emit_byte(0);      
-  emit_word(1);
-  emit_word(1);
-  emit_byte(0);     
-  emit_byte(0);
+  static const uint8 s_app0[] =
+  {
+    0xFF, M_APP0, 0, 2 + 4 + 1 + 2 + 1 + 2 + 2 + 1 + 1,
+    0x4A, 0x46, 0x49, 0x46, 0, /* Identifier: ASCII "JFIF" */
+    1, 1, /* Version 1.1 */
+    0, 0, 1, 0, 1, /* Aspect ratio 1:1 */
+    0, 0 /* No thumbnail */
+  };
+  emit_buf(s_app0, sizeof(s_app0));
 }
 
 void jpeg_encoder::emit_dqt()
 {
   for (int i = 0; i < ((m_num_components == 3) ? 2 : 1); i++)
   {
-    emit_marker(M_DQT);
-    emit_word(64 + 1 + 2);
-    emit_byte(static_cast<uint8>(i));
+    uint8 dqt[2 + 2 + 1 + 64] = { 0xFF, M_DQT, 0, 64 + 1 + 2, static_cast<uint8>(i) };
     for (int j = 0; j < 64; j++)
-      emit_byte(static_cast<uint8>(m_quantization_tables[i][j]));
+      dqt[5 + j] = static_cast<uint8>(m_quantization_tables[i][j]);
+    emit_buf(dqt, sizeof(dqt));
   }
 }
 
 void jpeg_encoder::emit_sof()
 {
-  emit_marker(M_SOF0);                           
+  emit_marker(m_params.m_progressive_flag ? M_SOF2 : M_SOF0);
   emit_word(3 * m_num_components + 2 + 5 + 1);
   emit_byte(8);                                  
   emit_word(m_image_y);
@@ -286,12 +678,8 @@ void jpeg_encoder::emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag)
 
   emit_word(length + 2 + 1 + 16);
   emit_byte(static_cast<uint8>(index + (ac_flag << 4)));
-
-  for (int i = 1; i <= 16; i++)
-    emit_byte(bits[i]);
-
-  for (int i = 0; i < length; i++)
-    emit_byte(val[i]);
+  emit_buf(bits + 1, 16);
+  emit_buf(val, length);
 }
 
 void jpeg_encoder::emit_dhts()
@@ -305,35 +693,80 @@ void jpeg_encoder::emit_dhts()
   }
 }
 
-void jpeg_encoder::emit_sos()
+void jpeg_encoder::emit_sos(int num_scan_comps, const uint8 *pScan_comps, int ss, int se, int ah, int al)
 {
   emit_marker(M_SOS);
-  emit_word(2 * m_num_components + 2 + 1 + 3);
-  emit_byte(m_num_components);
-  for (int i = 0; i < m_num_components; i++)
+  emit_word(2 * num_scan_comps + 2 + 1 + 3);
+  emit_byte(static_cast<uint8>(num_scan_comps));
+  for (int i = 0; i < num_scan_comps; i++)
   {
-    emit_byte(static_cast<uint8>(i + 1));
-    if (i == 0)
+    emit_byte(static_cast<uint8>(pScan_comps[i] + 1));
+    if (pScan_comps[i] == 0)
       emit_byte((0 << 4) + 0);
     else
       emit_byte((1 << 4) + 1);
   }
-  emit_byte(0);    
-  emit_byte(63);
-  emit_byte(0);
+  emit_byte(static_cast<uint8>(ss));
+  emit_byte(static_cast<uint8>(se));
+  emit_byte(static_cast<uint8>((ah << 4) + al));
 }
 
-void jpeg_encoder::emit_markers()
+// ppSof receives where SOF was written, which is only meaningful while the whole block fits in the current window.
+void jpeg_encoder::emit_marker_block(uint8 **ppSof)
 {
   emit_marker(M_SOI);
   emit_jfif_app0();
   emit_dqt();
+  if (ppSof)
+    *ppSof = m_pOut_buf;
   emit_sof();
-  emit_dhts();
-  emit_sos();
+  if (!m_omit_dht_flag)
+    emit_dhts();
+  if (m_restart_interval)
+  {
+    emit_marker(M_DRI);
+    emit_word(4);
+    emit_word(m_restart_interval);
+  }
+  static const uint8 s_all_comps[3] = { 0, 1, 2 };
+  emit_sos(m_num_components, s_all_comps, 0, 63, 0, 0);
+}
+
+// With the standard Huffman tables, the markers depend on the image size only through SOF, so they're built once per parameter set
+// into m_header_cache and written with the dimensions patched in.
+void jpeg_encoder::emit_markers()
+{
+  if (!m_std_huff_tables_flag)
+  {
+    emit_marker_block();
+    flush_output_buffer();
+    return;
+  }
+
+  const int key[] = { m_params.m_quality, m_params.m_no_chroma_discrim_flag, m_params.m_progressive_flag, m_num_components, m_comp_h_samp[0], m_comp_v_samp[0], static_cast<int>(m_restart_interval), m_omit_dht_flag };
+  if ((!m_header_cache_size) || (memcmp(key, m_header_key, sizeof(key))))
+  {
+    // The block is under 700 bytes with the standard tables, so it never leaves m_header_cache.
+    flush_output_buffer();
+    m_pOut_buf = m_pOut_buf_start = m_header_cache;
+    m_out_buf_left = sizeof(m_header_cache);
+    uint8 *pSof = NULL;
+    emit_marker_block(&pSof);
+    m_header_sof_ofs = static_cast<uint>(pSof - m_header_cache);
+    m_header_cache_size = static_cast<uint>(m_pOut_buf - m_header_cache);
+    m_pOut_buf = m_pOut_buf_start = NULL;
+    m_out_buf_left = 0;
+    memcpy(m_header_key, key, sizeof(key));
+  }
+  uint8 *pDims = m_header_cache + m_header_sof_ofs + 5;
+  pDims[0] = static_cast<uint8>(m_image_y >> 8); pDims[1] = static_cast<uint8>(m_image_y);
+  pDims[2] = static_cast<uint8>(m_image_x >> 8); pDims[3] = static_cast<uint8>(m_image_x);
+  emit_buf(m_header_cache, m_header_cache_size);
+  flush_output_buffer();
 }
 
-void jpeg_encoder::compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *bits, uint8 *val)
+// Each entry of codes packs a symbol's code with its length: (code << 8) | size.
+void jpeg_encoder::compute_huffman_table(uint *codes, uint8 *bits, uint8 *val)
 {
   int i, l, last_p, si;
   uint8 huff_size[257];
@@ -355,12 +788,8 @@ void jpeg_encoder::compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *
     si++;
   }
   memset(codes, 0, sizeof(codes[0])*256);
-  memset(code_sizes, 0, sizeof(code_sizes[0])*256);
   for (p = 0; p < last_p; p++)
-  {
-    codes[val[p]]      = huff_code[p];
-    code_sizes[val[p]] = huff_size[p];
-  }
+    codes[val[p]] = (huff_code[p] << 8) | huff_size[p];
 }
 
 void jpeg_encoder::compute_quant_table(int32 *pDst, int16 *pSrc)
@@ -377,30 +806,100 @@ void jpeg_encoder::compute_quant_table(int32 *pDst, int16 *pSrc)
   }
 }
 
+void jpeg_encoder::compute_quant_recips(uint16 *pDst, const int32 *pSrc)
+{
+  for (int i = 0; i < 64; i++)
+  {
+    const uint d = pSrc[i];
+    uint recip, corr, scale, keep = 0;
+    if (d <= 2)
+    {
+      // (t * 0xFFFF) >> 16 == t - 1 for 0 < t < 65536, so a correction of d (instead of d/2) absorbs the error.
+      recip = 0xFFFF; corr = d; scale = (d == 2) ? 0x8000 : 0; keep = (d == 1) ? 0xFFFF : 0;
+    }
+    else
+    {
+      uint b = 0;
+      while ((2U << b) <= d) b++;
+      uint r = 16 + b;
+      recip = (1U << r) / d; corr = d >> 1;
+      const uint rem = (1U << r) % d;
+      if (!rem) { recip >>= 1; r--; }
+      else if (rem <= (d >> 1)) corr++;
+      else recip++;
+      scale = 1U << (32 - r);
+    }
+    const int k = s_zag[i];
+    pDst[QUANT_RECIP * 64 + k] = static_cast<uint16>(recip);
+    pDst[QUANT_CORR * 64 + k] = static_cast<uint16>(corr);
+    pDst[QUANT_SCALE * 64 + k] = static_cast<uint16>(scale);
+    pDst[QUANT_KEEP * 64 + k] = static_cast<uint16>(keep);
+  }
+}
+
+// The tables (and the standard Huffman codes below) are left in place between images, so a reused encoder only rebuilds them when the
+// quality or chroma discrimination setting changes.
+void jpeg_encoder::set_quality(int quality)
+{
+  m_params.m_quality = quality;
+  if ((quality == m_cached_quality) && (m_params.m_no_chroma_discrim_flag == m_cached_no_chroma_discrim_flag))
+    return;
+  m_cached_quality = quality;
+  m_cached_no_chroma_discrim_flag = m_params.m_no_chroma_discrim_flag;
+  compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
+  compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+  compute_quant_recips(m_quantization_recips[0][0], m_quantization_tables[0]);
+  compute_quant_recips(m_quantization_recips[1][0], m_quantization_tables[1]);
+}
+
+void jpeg_encoder::set_std_huffman_tables()
+{
+  if (m_std_huff_tables_flag)
+    return;
+  memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val [0+0], s_dc_lum_val, DC_LUM_CODES);
+  memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val [2+0], s_ac_lum_val, AC_LUM_CODES);
+  memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val [0+1], s_dc_chroma_val, DC_CHROMA_CODES);
+  memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val [2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+  for (int t = 0; t < 4; t++)
+    compute_huffman_table(&m_huff_codes[t][0], m_huff_bits[t], m_huff_val[t]);
+  m_std_huff_tables_flag = true;
+}
+
 void jpeg_encoder::first_pass_init()
 {
   m_bit_buffer = 0; m_bits_in = 0;
   memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
   m_mcu_y_ofs = 0;
+  m_restart_mcus_left = m_strip_first_interval ? 0 : m_restart_interval;
+  m_next_restart_num = m_strip_first_interval ? static_cast<uint8>((m_strip_first_interval - 1) & 7) : 0;
   m_pass_num = 1;
 }
 
 bool jpeg_encoder::second_pass_init()
 {
-  compute_huffman_table(&m_huff_codes[0+0][0], &m_huff_code_sizes[0+0][0], m_huff_bits[0+0], m_huff_val[0+0]);
-  compute_huffman_table(&m_huff_codes[2+0][0], &m_huff_code_sizes[2+0][0], m_huff_bits[2+0], m_huff_val[2+0]);
-  if (m_num_components > 1)
+  if (!m_std_huff_tables_flag)
   {
-    compute_huffman_table(&m_huff_codes[0+1][0], &m_huff_code_sizes[0+1][0], m_huff_bits[0+1], m_huff_val[0+1]);
-    compute_huffman_table(&m_huff_codes[2+1][0], &m_huff_code_sizes[2+1][0], m_huff_bits[2+1], m_huff_val[2+1]);
+    compute_huffman_table(&m_huff_codes[0+0][0], m_huff_bits[0+0], m_huff_val[0+0]);
+    compute_huffman_table(&m_huff_codes[2+0][0], m_huff_bits[2+0], m_huff_val[2+0]);
+    if (m_num_components > 1)
+    {
+      compute_huffman_table(&m_huff_codes[0+1][0], m_huff_bits[0+1], m_huff_val[0+1]);
+      compute_huffman_table(&m_huff_codes[2+1][0], m_huff_bits[2+1], m_huff_val[2+1]);
+    }
   }
   first_pass_init();
-  emit_markers();
+  if (!m_strip_flag)
+    emit_markers();
   m_pass_num = 2;
   return true;
 }
 
-bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
+uint64 jpeg_encoder::get_coefficient_buffer_size() const
+{
+  return static_cast<uint64>(m_mcus_per_row) * (m_image_y_mcu / m_mcu_y) * m_blocks_per_mcu * 64 * sizeof(int16);
+}
+
+bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, pixel_format_t pixel_format)
 {
   m_num_components = 3;
   switch (m_params.m_subsampling)
@@ -438,293 +937,716 @@ bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
   }
 
   m_image_x        = p_x_res; m_image_y = p_y_res;
-  m_image_bpp      = src_channels;
-  m_image_bpl      = m_image_x * src_channels;
+  m_pixel_format   = pixel_format;
   m_image_x_mcu    = (m_image_x + m_mcu_x - 1) & (~(m_mcu_x - 1));
   m_image_y_mcu    = (m_image_y + m_mcu_y - 1) & (~(m_mcu_y - 1));
-  m_image_bpl_xlt  = m_image_x * m_num_components;
-  m_image_bpl_mcu  = m_image_x_mcu * m_num_components;
+  m_plane_bpl      = m_image_x_mcu + 16;
+  m_image_bpl_mcu  = m_plane_bpl * m_num_components;
   m_mcus_per_row   = m_image_x_mcu / m_mcu_x;
-
-  if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(m_image_bpl_mcu * m_mcu_y))) == NULL) return false;
+  m_blocks_per_mcu = (m_num_components == 1) ? 1 : (m_comp_h_samp[0] * m_comp_v_samp[0] + 2);
+  if ((!m_params.m_progressive_flag) && (m_params.m_restart_in_rows_flag) && (m_params.m_restart_interval > 0xFFFFU / m_mcus_per_row)) return false;
+  m_restart_interval = m_params.m_progressive_flag ? 0 : (m_params.m_restart_in_rows_flag ? (m_params.m_restart_interval * m_mcus_per_row) : m_params.m_restart_interval);
+  if (m_restart_interval > 0xFFFF) return false;
+
+  // A reused encoder keeps its MCU lines unless this image needs more.
+  const uint mcu_lines_size = m_image_bpl_mcu * m_mcu_y;
+  if (mcu_lines_size > m_mcu_lines_size)
+  {
+    jpge_free(m_mcu_lines[0]);
+    m_mcu_lines_size = 0;
+    if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(mcu_lines_size))) == NULL) return false;
+    m_mcu_lines_size = mcu_lines_size;
+  }
   for (int i = 1; i < m_mcu_y; i++)
     m_mcu_lines[i] = m_mcu_lines[i-1] + m_image_bpl_mcu;
 
-  compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-  compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+  set_quality(m_params.m_quality);
 
-  m_out_buf_left = JPGE_OUT_BUF_SIZE;
-  m_pOut_buf = m_out_buf;
+  m_pOut_buf = m_pOut_buf_start = NULL;
+  m_out_buf_left = 0;
 
-  if (m_params.m_two_pass_flag)
+  if ((m_params.m_two_pass_flag) || (m_params.m_progressive_flag))
   {
+    // Progressive scans are coded from the buffered coefficients at the end of the image, so they always need the buffer.
+    const uint64 buf_size = get_coefficient_buffer_size();
+    if ((m_params.m_progressive_flag) || ((m_params.m_max_coefficient_buffer_size) && (buf_size <= m_params.m_max_coefficient_buffer_size)))
+    {
+      if (buf_size == static_cast<size_t>(buf_size))
+        m_pCoefficient_buffer = static_cast<int16*>(jpge_malloc(static_cast<size_t>(buf_size)));
+      if ((m_params.m_progressive_flag) && (!m_pCoefficient_buffer)) return false;
+      m_num_buffered_blocks = 0;
+    }
     clear_obj(m_huff_count);
     first_pass_init();
   }
   else
   {
-    memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val [0+0], s_dc_lum_val, DC_LUM_CODES);
-    memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val [2+0], s_ac_lum_val, AC_LUM_CODES);
-    memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val [0+1], s_dc_chroma_val, DC_CHROMA_CODES);
-    memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val [2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+    set_std_huffman_tables();
     if (!second_pass_init()) return false;
   }
   return m_all_stream_writes_succeeded;
 }
 
-void jpeg_encoder::load_block_8_8_grey(int x)
+// The samples are indexed from the loop counter rather than stepped alongside the row pointers: GCC 12's induction variable
+// optimization otherwise rewrites the SSE2 store relative to m_mcu_lines with a null base, after which the calls are dropped as pure.
+void jpeg_encoder::load_block_8_8(int x, int y, int c)
 {
-  uint8 *pSrc;
-  sample_array_t *pDst = m_sample_array;
-  x <<= 3;
-  for (int i = 0; i < 8; i++, pDst += 8)
+  x = (c * m_plane_bpl) + (x << 3);
+  y <<= 3;
+  for (int i = 0; i < 64; i += 8)
   {
-    pSrc = m_mcu_lines[i] + x;
+    const uint8 *pSrc = m_mcu_lines[y + (i >> 3)] + x;
+    sample_array_t *pDst = m_sample_array + i;
+#if JPGE_USE_SSE2
+    __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pSrc)), _mm_setzero_si128());
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst), _mm_sub_epi16(v, _mm_set1_epi16(128)));
+#else
     pDst[0] = pSrc[0] - 128; pDst[1] = pSrc[1] - 128; pDst[2] = pSrc[2] - 128; pDst[3] = pSrc[3] - 128;
     pDst[4] = pSrc[4] - 128; pDst[5] = pSrc[5] - 128; pDst[6] = pSrc[6] - 128; pDst[7] = pSrc[7] - 128;
+#endif
   }
 }
 
-void jpeg_encoder::load_block_8_8(int x, int y, int c)
+// Reduces 16 samples of a chroma row to 8 horizontal taps: the box filter sums each pair, the filtered (centered) variant weights the
+// surrounding four samples 1,3,3,1. The filtered taps read one sample either side of the 16, which the plane padding provides.
+#if JPGE_USE_SSE2
+static inline __m128i sse2_downsample_taps(const uint8 *pSrc, bool filtered)
 {
-  uint8 *pSrc;
-  sample_array_t *pDst = m_sample_array;
-  x = (x * (8 * 3)) + c;
-  y <<= 3;
-  for (int i = 0; i < 8; i++, pDst += 8)
+  const __m128i m = _mm_set1_epi16(0xFF);
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+  __m128i s = _mm_add_epi16(_mm_and_si128(v, m), _mm_srli_epi16(v, 8));
+  if (!filtered)
+    return s;
+  s = _mm_add_epi16(s, _mm_add_epi16(s, s));
+  __m128i prev = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc - 1)), m);
+  __m128i next = _mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + 1)), 8);
+  return _mm_add_epi16(s, _mm_add_epi16(prev, next));
+}
+#endif
+
+static inline int downsample_taps(const uint8 *pSrc, int i, bool filtered)
+{
+  const int s = pSrc[i * 2] + pSrc[i * 2 + 1];
+  return filtered ? (s * 3 + pSrc[i * 2 - 1] + pSrc[i * 2 + 2]) : s;
+}
+
+// Produces 8 level-shifted samples from 16 samples of one (H2V1) or two (H2V2) chroma rows. Even and odd outputs are rounded with bias0 and bias1.
+template<bool two_rows, bool filtered> static inline void downsample_16(int16 *pDst, const uint8 *pSrc1, const uint8 *pSrc2, int bias0, int bias1)
+{
+  const int shift = (two_rows ? 2 : 1) + (filtered ? 2 : 0);
+#if JPGE_USE_SSE2
+  __m128i s = sse2_downsample_taps(pSrc1, filtered);
+  if (two_rows)
+    s = _mm_add_epi16(s, sse2_downsample_taps(pSrc2, filtered));
+  s = _mm_srli_epi16(_mm_add_epi16(s, _mm_set1_epi32(pack_coeffs(bias0, bias1))), shift);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst), _mm_sub_epi16(s, _mm_set1_epi16(128)));
+#else
+  for (int i = 0; i < 8; i++)
   {
-    pSrc = m_mcu_lines[y + i] + x;
-    pDst[0] = pSrc[0 * 3] - 128; pDst[1] = pSrc[1 * 3] - 128; pDst[2] = pSrc[2 * 3] - 128; pDst[3] = pSrc[3 * 3] - 128;
-    pDst[4] = pSrc[4 * 3] - 128; pDst[5] = pSrc[5 * 3] - 128; pDst[6] = pSrc[6 * 3] - 128; pDst[7] = pSrc[7 * 3] - 128;
+    int s = downsample_taps(pSrc1, i, filtered);
+    if (two_rows)
+      s += downsample_taps(pSrc2, i, filtered);
+    pDst[i] = static_cast<int16>(((s + ((i & 1) ? bias1 : bias0)) >> shift) - 128);
   }
+#endif
 }
 
 void jpeg_encoder::load_block_16_8(int x, int c)
 {
-  uint8 *pSrc1, *pSrc2;
   sample_array_t *pDst = m_sample_array;
-  x = (x * (16 * 3)) + c;
-  int a = 0, b = 2;
+  x = (c * m_plane_bpl) + (x << 4);
   for (int i = 0; i < 16; i += 2, pDst += 8)
   {
-    pSrc1 = m_mcu_lines[i + 0] + x;
-    pSrc2 = m_mcu_lines[i + 1] + x;
-    pDst[0] = ((pSrc1[ 0 * 3] + pSrc1[ 1 * 3] + pSrc2[ 0 * 3] + pSrc2[ 1 * 3] + a) >> 2) - 128; pDst[1] = ((pSrc1[ 2 * 3] + pSrc1[ 3 * 3] + pSrc2[ 2 * 3] + pSrc2[ 3 * 3] + b) >> 2) - 128;
-    pDst[2] = ((pSrc1[ 4 * 3] + pSrc1[ 5 * 3] + pSrc2[ 4 * 3] + pSrc2[ 5 * 3] + a) >> 2) - 128; pDst[3] = ((pSrc1[ 6 * 3] + pSrc1[ 7 * 3] + pSrc2[ 6 * 3] + pSrc2[ 7 * 3] + b) >> 2) - 128;
-    pDst[4] = ((pSrc1[ 8 * 3] + pSrc1[ 9 * 3] + pSrc2[ 8 * 3] + pSrc2[ 9 * 3] + a) >> 2) - 128; pDst[5] = ((pSrc1[10 * 3] + pSrc1[11 * 3] + pSrc2[10 * 3] + pSrc2[11 * 3] + b) >> 2) - 128;
-    pDst[6] = ((pSrc1[12 * 3] + pSrc1[13 * 3] + pSrc2[12 * 3] + pSrc2[13 * 3] + a) >> 2) - 128; pDst[7] = ((pSrc1[14 * 3] + pSrc1[15 * 3] + pSrc2[14 * 3] + pSrc2[15 * 3] + b) >> 2) - 128;
-    int temp = a; a = b; b = temp;
+    const uint8 *pSrc1 = m_mcu_lines[i + 0] + x, *pSrc2 = m_mcu_lines[i + 1] + x;
+    if (m_params.m_filtered_chroma_flag)
+      downsample_16<true, true>(pDst, pSrc1, pSrc2, 8, 8);
+    else if (i & 2)
+      downsample_16<true, false>(pDst, pSrc1, pSrc2, 2, 0);
+    else
+      downsample_16<true, false>(pDst, pSrc1, pSrc2, 0, 2);
   }
 }
 
 void jpeg_encoder::load_block_16_8_8(int x, int c)
 {
-  uint8 *pSrc1;
   sample_array_t *pDst = m_sample_array;
-  x = (x * (16 * 3)) + c;
+  x = (c * m_plane_bpl) + (x << 4);
   for (int i = 0; i < 8; i++, pDst += 8)
   {
-    pSrc1 = m_mcu_lines[i + 0] + x;
-    pDst[0] = ((pSrc1[ 0 * 3] + pSrc1[ 1 * 3]) >> 1) - 128; pDst[1] = ((pSrc1[ 2 * 3] + pSrc1[ 3 * 3]) >> 1) - 128;
-    pDst[2] = ((pSrc1[ 4 * 3] + pSrc1[ 5 * 3]) >> 1) - 128; pDst[3] = ((pSrc1[ 6 * 3] + pSrc1[ 7 * 3]) >> 1) - 128;
-    pDst[4] = ((pSrc1[ 8 * 3] + pSrc1[ 9 * 3]) >> 1) - 128; pDst[5] = ((pSrc1[10 * 3] + pSrc1[11 * 3]) >> 1) - 128;
-    pDst[6] = ((pSrc1[12 * 3] + pSrc1[13 * 3]) >> 1) - 128; pDst[7] = ((pSrc1[14 * 3] + pSrc1[15 * 3]) >> 1) - 128;
+    const uint8 *pSrc = m_mcu_lines[i] + x;
+    if (m_params.m_filtered_chroma_flag)
+      downsample_16<false, true>(pDst, pSrc, NULL, 4, 4);
+    else
+      downsample_16<false, false>(pDst, pSrc, NULL, 0, 0);
   }
 }
 
-void jpeg_encoder::load_quantized_coefficients(int component_num)
+void jpeg_encoder::load_quantized_coefficients(int component_num, const sample_array_t *pSrc)
 {
-  int32 *q = m_quantization_tables[component_num > 0];
-  int16 *pDst = m_coefficient_array;
+  const uint16 *pRecips = m_quantization_recips[component_num > 0][0];
+  int16 quantized[64];
+  quantize_block(quantized, pSrc, pRecips);
   for (int i = 0; i < 64; i++)
+    m_coefficient_array[i] = quantized[s_zag[i]];
+}
+
+// Hands the bytes written since the window was opened to the stream. The next byte opens a new window.
+void jpeg_encoder::flush_output_buffer()
+{
+  const uint len = static_cast<uint>(m_pOut_buf - m_pOut_buf_start);
+  if (len)
+    m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && ((m_pOut_buf_start == m_out_buf) ? m_pStream->put_buf(m_out_buf, len) : m_pStream->commit(len));
+  m_pOut_buf = m_pOut_buf_start = NULL;
+  m_out_buf_left = 0;
+}
+
+// Output goes straight into the stream's memory when it offers a write window, and through m_out_buf otherwise.
+void jpeg_encoder::open_output_window()
+{
+  flush_output_buffer();
+  uint avail_len = 0;
+  uint8 *pWindow = m_pStream->get_write_window(JPGE_MIN_WINDOW_SIZE, avail_len);
+  if ((!pWindow) || (avail_len < JPGE_MIN_WINDOW_SIZE))
   {
-    sample_array_t j = m_sample_array[s_zag[i]];
-    if (j < 0)
-    {
-      if ((j = -j + (*q >> 1)) < *q)
-        *pDst++ = 0;
-      else
-        *pDst++ = static_cast<int16>(-(j / *q));
-    }
-    else
-    {
-      if ((j = j + (*q >> 1)) < *q)
-        *pDst++ = 0;
-      else
-        *pDst++ = static_cast<int16>((j / *q));
-    }
-    q++;
+    pWindow = m_out_buf;
+    avail_len = JPGE_OUT_BUF_SIZE;
   }
+  m_pOut_buf = m_pOut_buf_start = pWindow;
+  m_out_buf_left = avail_len;
 }
 
-void jpeg_encoder::flush_output_buffer()
+static inline uint count_trailing_zeros64(uint64 v)
+{
+#if defined(_MSC_VER) && !defined(__clang__) && defined(_M_X64)
+  unsigned long i; _BitScanForward64(&i, v); return i;
+#elif defined(_MSC_VER) && !defined(__clang__)
+  unsigned long i;
+  if (static_cast<uint32>(v)) { _BitScanForward(&i, static_cast<uint32>(v)); return i; }
+  _BitScanForward(&i, static_cast<uint32>(v >> 32)); return i + 32;
+#elif defined(__GNUC__)
+  return __builtin_ctzll(v);
+#else
+  uint i = 0; while (!(v & 1)) { v >>= 1; i++; } return i;
+#endif
+}
+
+// Number of bits needed to hold v: 0 for 0, otherwise floor(log2(v)) + 1.
+static inline uint bit_length(uint v)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long i; return _BitScanReverse(&i, v) ? (i + 1) : 0;
+#elif defined(__GNUC__)
+  return v ? (32 - __builtin_clz(v)) : 0;
+#else
+  uint n = 0; while (v) { n++; v >>= 1; } return n;
+#endif
+}
+
+// Bit i is set when coefficient i of the (zig-zag ordered) block is nonzero.
+static inline uint64 nonzero_coefficient_mask(const int16 *pSrc)
 {
-  if (m_out_buf_left != JPGE_OUT_BUF_SIZE)
-    m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, JPGE_OUT_BUF_SIZE - m_out_buf_left);
-  m_pOut_buf = m_out_buf;
-  m_out_buf_left = JPGE_OUT_BUF_SIZE;
+#if JPGE_USE_SSE2
+  const __m128i z = _mm_setzero_si128();
+  uint64 zero_mask = 0;
+  for (int i = 0; i < 64; i += 16)
+  {
+    __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i)), z);
+    __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i + 8)), z);
+    zero_mask |= static_cast<uint64>(static_cast<uint>(_mm_movemask_epi8(_mm_packs_epi16(a, b)))) << i;
+  }
+  return ~zero_mask;
+#else
+  uint64 mask = 0;
+  for (int i = 0; i < 64; i++)
+    if (pSrc[i]) mask |= static_cast<uint64>(1) << i;
+  return mask;
+#endif
 }
 
+// Bits accumulate right-aligned in the 64-bit m_bit_buffer and leave it 32 at a time. A word with no 0xFF byte needs no stuffing and is stored
+// in one go; otherwise (or near the end of m_out_buf) it goes out byte by byte.
 void jpeg_encoder::put_bits(uint bits, uint len)
 {
-  m_bit_buffer |= ((uint32)bits << (24 - (m_bits_in += len)));
+  m_bit_buffer = (m_bit_buffer << len) | bits;
+  if ((m_bits_in += len) < 32)
+    return;
+  m_bits_in -= 32;
+  const uint32 c = static_cast<uint32>(m_bit_buffer >> m_bits_in), n = ~c;
+  if ((((n - 0x01010101U) & ~n & 0x80808080U) == 0) && (m_out_buf_left >= 4))
+  {
+    m_pOut_buf[0] = static_cast<uint8>(c >> 24); m_pOut_buf[1] = static_cast<uint8>(c >> 16);
+    m_pOut_buf[2] = static_cast<uint8>(c >> 8); m_pOut_buf[3] = static_cast<uint8>(c);
+    m_pOut_buf += 4;
+    m_out_buf_left -= 4;
+  }
+  else
+  {
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+      const uint8 b = static_cast<uint8>(c >> shift);
+      JPGE_PUT_BYTE(b);
+      if (b == 0xFF) JPGE_PUT_BYTE(0);
+    }
+  }
+}
+
+// Writes out every complete byte still held in m_bit_buffer; fewer than 8 bits remain afterwards.
+void jpeg_encoder::flush_bits()
+{
   while (m_bits_in >= 8)
   {
-    uint8 c;
-    #define JPGE_PUT_BYTE(c) { *m_pOut_buf++ = (c); if (--m_out_buf_left == 0) flush_output_buffer(); }
-    JPGE_PUT_BYTE(c = (uint8)((m_bit_buffer >> 16) & 0xFF));
-    if (c == 0xFF) JPGE_PUT_BYTE(0);
-    m_bit_buffer <<= 8;
     m_bits_in -= 8;
+    const uint8 c = static_cast<uint8>(m_bit_buffer >> m_bits_in);
+    JPGE_PUT_BYTE(c);
+    if (c == 0xFF) JPGE_PUT_BYTE(0);
   }
 }
 
-void jpeg_encoder::code_coefficients_pass_one(int component_num)
+void jpeg_encoder::code_coefficients_pass_one(int component_num, bool dc_only)
 {
   if (component_num >= 3) return;
-  int i, run_len, nbits, temp1;
   int16 *src = m_coefficient_array;
   uint32 *dc_count = component_num ? m_huff_count[0 + 1] : m_huff_count[0 + 0], *ac_count = component_num ? m_huff_count[2 + 1] : m_huff_count[2 + 0];
 
-  temp1 = src[0] - m_last_dc_val[component_num];
+  int temp1 = src[0] - m_last_dc_val[component_num];
   m_last_dc_val[component_num] = src[0];
   if (temp1 < 0) temp1 = -temp1;
+  dc_count[bit_length(temp1)]++;
 
-  nbits = 0;
-  while (temp1)
+  // Only the nonzero AC coefficients are visited; the zero runs between them fall out of the bit positions. With dc_only the AC
+  // coefficients are known to be zero and are not even looked at.
+  uint64 mask = dc_only ? 0 : (nonzero_coefficient_mask(src) & ~static_cast<uint64>(1));
+  int last = 0;
+  while (mask)
   {
-    nbits++; temp1 >>= 1;
+    const int i = count_trailing_zeros64(mask);
+    mask &= mask - 1;
+    int run_len = i - last - 1;
+    last = i;
+    for ( ; run_len >= 16; run_len -= 16)
+      ac_count[0xF0]++;
+    if ((temp1 = src[i]) < 0) temp1 = -temp1;
+    ac_count[(run_len << 4) + bit_length(temp1)]++;
   }
-
-  dc_count[nbits]++;
-  for (run_len = 0, i = 1; i < 64; i++)
-  {
-    if ((temp1 = m_coefficient_array[i]) == 0)
-      run_len++;
-    else
-    {
-      while (run_len >= 16)
-      {
-        ac_count[0xF0]++;
-        run_len -= 16;
-      }
-      if (temp1 < 0) temp1 = -temp1;
-      nbits = 1;
-      while (temp1 >>= 1) nbits++;
-      ac_count[(run_len << 4) + nbits]++;
-      run_len = 0;
-    }
-  }
-  if (run_len) ac_count[0]++;
+  if (last != 63) ac_count[0]++;
 }
 
-void jpeg_encoder::code_coefficients_pass_two(int component_num)
+void jpeg_encoder::code_coefficients_pass_two(int component_num, bool dc_only)
 {
-  int i, j, run_len, nbits, temp1, temp2;
   int16 *pSrc = m_coefficient_array;
-  uint *codes[2];
-  uint8 *code_sizes[2];
-
-  if (component_num == 0)
-  {
-    codes[0] = m_huff_codes[0 + 0]; codes[1] = m_huff_codes[2 + 0];
-    code_sizes[0] = m_huff_code_sizes[0 + 0]; code_sizes[1] = m_huff_code_sizes[2 + 0];
-  }
-  else
-  {
-    codes[0] = m_huff_codes[0 + 1]; codes[1] = m_huff_codes[2 + 1];
-    code_sizes[0] = m_huff_code_sizes[0 + 1]; code_sizes[1] = m_huff_code_sizes[2 + 1];
-  }
+  const uint *dc_codes = m_huff_codes[0 + (component_num > 0)], *ac_codes = m_huff_codes[2 + (component_num > 0)];
 
+  int temp1, temp2;
   temp1 = temp2 = pSrc[0] - m_last_dc_val[component_num];
   m_last_dc_val[component_num] = pSrc[0];
-
   if (temp1 < 0)
   {
     temp1 = -temp1; temp2--;
   }
-
-  nbits = 0;
-  while (temp1)
+  uint nbits = bit_length(temp1);
+  // The Huffman code and the magnitude bits that follow it go out in a single put_bits() call.
+  uint code = dc_codes[nbits];
+  put_bits(((code >> 8) << nbits) | (temp2 & ((1 << nbits) - 1)), (code & 0xFF) + nbits);
+
+  uint64 mask = dc_only ? 0 : (nonzero_coefficient_mask(pSrc) & ~static_cast<uint64>(1));
+  int last = 0;
+  while (mask)
   {
-    nbits++; temp1 >>= 1;
+    const int i = count_trailing_zeros64(mask);
+    mask &= mask - 1;
+    int run_len = i - last - 1;
+    last = i;
+    for ( ; run_len >= 16; run_len -= 16)
+      put_bits(ac_codes[0xF0] >> 8, ac_codes[0xF0] & 0xFF);
+    if ((temp2 = temp1 = pSrc[i]) < 0)
+    {
+      temp1 = -temp1; temp2--;
+    }
+    nbits = bit_length(temp1);
+    code = ac_codes[(run_len << 4) + nbits];
+    put_bits(((code >> 8) << nbits) | (temp2 & ((1 << nbits) - 1)), (code & 0xFF) + nbits);
   }
+  if (last != 63)
+    put_bits(ac_codes[0] >> 8, ac_codes[0] & 0xFF);
+}
 
-  put_bits(codes[0][nbits], code_sizes[0][nbits]);
-  if (nbits) put_bits(temp2 & ((1 << nbits) - 1), nbits);
-
-  for (run_len = 0, i = 1; i < 64; i++)
+template<int mode> inline void jpeg_encoder::code_block(int component_num)
+{
+  // A uniform block of level-shifted value s transforms to DC = 8 * s with every AC term exactly 0, so it only needs its DC quantized and
+  // coded before an EOB.
+  if (is_flat_block(m_sample_array))
   {
-    if ((temp1 = m_coefficient_array[i]) == 0)
-      run_len++;
+    if (mode == BLOCK_CACHE_DCT)
+    {
+      int16 *pDst = m_pDCT_cache + m_num_buffered_blocks++ * 64;
+      pDst[0] = (int16)(m_sample_array[0] * 8);
+      memset(pDst + 1, 0, 63 * sizeof(int16));
+      return;
+    }
+    const uint16 *pRecips = m_quantization_recips[component_num > 0][0];
+    m_coefficient_array[0] = quantize_coeff(m_sample_array[0] * 8, pRecips[QUANT_RECIP * 64], pRecips[QUANT_CORR * 64], pRecips[QUANT_SCALE * 64], pRecips[QUANT_KEEP * 64]);
+    if (mode == BLOCK_CODE)
+      code_coefficients_pass_two(component_num, true);
     else
     {
-      while (run_len >= 16)
-      {
-        put_bits(codes[1][0xF0], code_sizes[1][0xF0]);
-        run_len -= 16;
-      }
-      if ((temp2 = temp1) < 0)
+      if (mode != BLOCK_BUFFER)
+        code_coefficients_pass_one(component_num, true);
+      if (mode != BLOCK_COUNT)
       {
-        temp1 = -temp1;
-        temp2--;
+        int16 *pDst = m_pCoefficient_buffer + m_num_buffered_blocks++ * 64;
+        pDst[0] = m_coefficient_array[0];
+        memset(pDst + 1, 0, 63 * sizeof(int16));
       }
-      nbits = 1;
-      while (temp1 >>= 1)
-        nbits++;
-      j = (run_len << 4) + nbits;
-      put_bits(codes[1][j], code_sizes[1][j]);
-      put_bits(temp2 & ((1 << nbits) - 1), nbits);
-      run_len = 0;
     }
+    return;
   }
-  if (run_len)
-    put_bits(codes[1][0], code_sizes[1][0]);
-}
-
-void jpeg_encoder::code_block(int component_num)
-{
   DCT2D(m_sample_array);
-  load_quantized_coefficients(component_num);
-  if (m_pass_num == 1)
-    code_coefficients_pass_one(component_num);
-  else
+  if (mode == BLOCK_CACHE_DCT)
+  {
+    memcpy(m_pDCT_cache + m_num_buffered_blocks++ * 64, m_sample_array, sizeof(m_sample_array));
+    return;
+  }
+  load_quantized_coefficients(component_num, m_sample_array);
+  if (mode == BLOCK_CODE)
     code_coefficients_pass_two(component_num);
+  else
+  {
+    if (mode != BLOCK_BUFFER)
+      code_coefficients_pass_one(component_num);
+    if (mode != BLOCK_COUNT)
+      memcpy(m_pCoefficient_buffer + m_num_buffered_blocks++ * 64, m_coefficient_array, sizeof(m_coefficient_array));
+  }
 }
 
-void jpeg_encoder::process_mcu_row()
+// Called before the first MCU of each restart interval but the first. Pass two pads the entropy-coded segment to a byte boundary with 1 bits
+// and writes RSTn; both passes reset the DC predictors, so pass one gathers the same DC statistics pass two codes.
+template<int pass> void jpeg_encoder::emit_restart()
 {
-  if (m_num_components == 1)
+  if (pass == 2)
   {
-    for (int i = 0; i < m_mcus_per_row; i++)
-    {
-      load_block_8_8_grey(i); code_block(0);
-    }
+    put_bits(0x7F, 7);
+    flush_bits();
+    m_bit_buffer = 0; m_bits_in = 0;
+    JPGE_PUT_BYTE(0xFF);
+    JPGE_PUT_BYTE(static_cast<uint8>(M_RST0 + m_next_restart_num));
+    m_next_restart_num = (m_next_restart_num + 1) & 7;
   }
-  else if ((m_comp_h_samp[0] == 1) && (m_comp_v_samp[0] == 1))
+  memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+  m_restart_mcus_left = m_restart_interval - 1;
+}
+
+// One instantiation per subsampling mode and block mode, so the per-block work (load, DCT, quantize, code) runs without re-testing the
+// sampling factors, the pass or where blocks are kept. With planar input the chroma planes already hold subsampled rows, which are loaded
+// like luma.
+template<subsampling_t subsampling, int mode, bool planar> void jpeg_encoder::encode_mcu_row()
+{
+  for (int i = 0; i < m_mcus_per_row; i++)
   {
-    for (int i = 0; i < m_mcus_per_row; i++)
+    if ((m_restart_interval) && (!m_restart_mcus_left--))
+      emit_restart<(mode == BLOCK_CODE) ? 2 : 1>();
+    if (subsampling == Y_ONLY)
     {
-      load_block_8_8(i, 0, 0); code_block(0); load_block_8_8(i, 0, 1); code_block(1); load_block_8_8(i, 0, 2); code_block(2);
+      load_block_8_8(i, 0, 0); code_block<mode>(0);
     }
-  }
-  else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 1))
-  {
-    for (int i = 0; i < m_mcus_per_row; i++)
+    else if (subsampling == H1V1)
     {
-      load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-      load_block_16_8_8(i, 1); code_block(1); load_block_16_8_8(i, 2); code_block(2);
+      load_block_8_8(i, 0, 0); code_block<mode>(0); load_block_8_8(i, 0, 1); code_block<mode>(1); load_block_8_8(i, 0, 2); code_block<mode>(2);
     }
-  }
-  else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 2))
-  {
-    for (int i = 0; i < m_mcus_per_row; i++)
+    else if (subsampling == H2V1)
     {
-      load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-      load_block_8_8(i * 2 + 0, 1, 0); code_block(0); load_block_8_8(i * 2 + 1, 1, 0); code_block(0);
-      load_block_16_8(i, 1); code_block(1); load_block_16_8(i, 2); code_block(2);
-    }
-  }
+      load_block_8_8(i * 2 + 0, 0, 0); code_block<mode>(0); load_block_8_8(i * 2 + 1, 0, 0); code_block<mode>(0);
+      if (planar)
+      {
+        load_block_8_8(i, 0, 1); code_block<mode>(1); load_block_8_8(i, 0, 2); code_block<mode>(2);
+      }
+      else
+      {
+        load_block_16_8_8(i, 1); code_block<mode>(1); load_block_16_8_8(i, 2); code_block<mode>(2);
+      }
+    }
+    else
+    {
+      load_block_8_8(i * 2 + 0, 0, 0); code_block<mode>(0); load_block_8_8(i * 2 + 1, 0, 0); code_block<mode>(0);
+      load_block_8_8(i * 2 + 0, 1, 0); code_block<mode>(0); load_block_8_8(i * 2 + 1, 1, 0); code_block<mode>(0);
+      if (planar)
+      {
+        load_block_8_8(i, 0, 1); code_block<mode>(1); load_block_8_8(i, 0, 2); code_block<mode>(2);
+      }
+      else
+      {
+        load_block_16_8(i, 1); code_block<mode>(1); load_block_16_8(i, 2); code_block<mode>(2);
+      }
+    }
+  }
+}
+
+#define JPGE_ROW_ENCODERS(subsampling, planar) { &jpeg_encoder::encode_mcu_row<subsampling, BLOCK_COUNT, planar>, \
+  &jpeg_encoder::encode_mcu_row<subsampling, BLOCK_COUNT_AND_BUFFER, planar>, &jpeg_encoder::encode_mcu_row<subsampling, BLOCK_BUFFER, planar>, \
+  &jpeg_encoder::encode_mcu_row<subsampling, BLOCK_CACHE_DCT, planar>, &jpeg_encoder::encode_mcu_row<subsampling, BLOCK_CODE, planar> }
+
+void jpeg_encoder::process_mcu_row(bool planar)
+{
+  typedef void (jpeg_encoder::*row_encoder_t)();
+  static const row_encoder_t s_row_encoders[2][4][NUM_BLOCK_MODES] =
+  {
+    { JPGE_ROW_ENCODERS(Y_ONLY, false), JPGE_ROW_ENCODERS(H1V1, false), JPGE_ROW_ENCODERS(H2V1, false), JPGE_ROW_ENCODERS(H2V2, false) },
+    { JPGE_ROW_ENCODERS(Y_ONLY, false), JPGE_ROW_ENCODERS(H1V1, false), JPGE_ROW_ENCODERS(H2V1, true), JPGE_ROW_ENCODERS(H2V2, true) }
+  };
+  const block_mode_t mode = (m_pass_num != 1) ? BLOCK_CODE : (m_pDCT_cache ? BLOCK_CACHE_DCT :
+    (m_params.m_progressive_flag ? BLOCK_BUFFER : (m_pCoefficient_buffer ? BLOCK_COUNT_AND_BUFFER : BLOCK_COUNT)));
+  (this->*s_row_encoders[planar][m_params.m_subsampling][mode])();
+}
+
+#undef JPGE_ROW_ENCODERS
+
+// Entropy codes the blocks buffered during pass one, in the same MCU order they were produced in.
+void jpeg_encoder::code_buffered_coefficients()
+{
+  const uint8 *pComponents = s_mcu_components[m_params.m_subsampling];
+  const int16 *pSrc = m_pCoefficient_buffer;
+  for (uint i = 0; i < m_num_buffered_blocks; i += m_blocks_per_mcu)
+  {
+    if ((m_restart_interval) && (!m_restart_mcus_left--))
+      emit_restart<2>();
+    for (int j = 0; j < m_blocks_per_mcu; j++, pSrc += 64)
+    {
+      memcpy(m_coefficient_array, pSrc, sizeof(m_coefficient_array));
+      code_coefficients_pass_two(pComponents[j]);
+    }
+  }
+}
+
+// Quantizes and codes the blocks of the DCT cache at the current quality, in the same MCU order they were produced in.
+template<int pass> void jpeg_encoder::code_dct_cache()
+{
+  const uint8 *pComponents = s_mcu_components[m_params.m_subsampling];
+  const int16 *pSrc = m_pDCT_cache;
+  for (uint i = 0; i < m_num_buffered_blocks; i += m_blocks_per_mcu)
+  {
+    if ((m_restart_interval) && (!m_restart_mcus_left--))
+      emit_restart<pass>();
+    for (int j = 0; j < m_blocks_per_mcu; j++, pSrc += 64)
+    {
+      load_quantized_coefficients(pComponents[j], pSrc);
+      if (pass == 1)
+        code_coefficients_pass_one(pComponents[j]);
+      else
+        code_coefficients_pass_two(pComponents[j]);
+    }
+  }
+}
+
+// The default scan script of libjpeg's jpeg_simple_progression(): DC at half precision, the low luma AC band, the rest of the AC at reduced
+// precision, then successive approximation refinement of every band. Components are 0 = Y, 1 = Cb, 2 = Cr.
+struct progressive_scan { uint8 m_num_comps, m_comps[3], m_ss, m_se, m_ah, m_al; };
+
+static const progressive_scan s_ycc_scans[] =
+{
+  { 3, { 0, 1, 2 }, 0, 0, 0, 1 }, { 1, { 0 }, 1, 5, 0, 2 }, { 1, { 2 }, 1, 63, 0, 1 }, { 1, { 1 }, 1, 63, 0, 1 }, { 1, { 0 }, 6, 63, 0, 2 },
+  { 1, { 0 }, 1, 63, 2, 1 }, { 3, { 0, 1, 2 }, 0, 0, 1, 0 }, { 1, { 2 }, 1, 63, 1, 0 }, { 1, { 1 }, 1, 63, 1, 0 }, { 1, { 0 }, 1, 63, 1, 0 }
+};
+
+static const progressive_scan s_grey_scans[] =
+{
+  { 1, { 0 }, 0, 0, 0, 1 }, { 1, { 0 }, 1, 5, 0, 2 }, { 1, { 0 }, 6, 63, 0, 2 }, { 1, { 0 }, 1, 63, 2, 1 }, { 1, { 0 }, 0, 0, 1, 0 }, { 1, { 0 }, 1, 63, 1, 0 }
+};
+
+// Pass one counts the symbol, pass two writes its code.
+template<int pass> inline void jpeg_encoder::put_symbol(int table_num, uint sym)
+{
+  if (pass == 1)
+    m_huff_count[table_num][sym]++;
+  else
+  {
+    const uint code = m_huff_codes[table_num][sym];
+    put_bits(code >> 8, code & 0xFF);
+  }
+}
+
+// Writes the pending run of end-of-bands, then the refinement correction bits that were held back behind it.
+template<int pass> void jpeg_encoder::put_eob_run(int table_num)
+{
+  if (!m_eob_run)
+    return;
+  const uint nbits = bit_length(m_eob_run) - 1;
+  put_symbol<pass>(table_num, nbits << 4);
+  if (pass == 2)
+  {
+    if (nbits)
+      put_bits(m_eob_run & ((1U << nbits) - 1), nbits);
+    for (uint i = 0; i < m_num_correction_bits; i++)
+      put_bits(m_correction_bits[i], 1);
+  }
+  m_eob_run = 0;
+  m_num_correction_bits = 0;
+}
+
+template<int pass> void jpeg_encoder::code_progressive_block(const int16 *pSrc, int component_num, const progressive_scan &scan)
+{
+  const int al = scan.m_al;
+  if (scan.m_ss == 0)
+  {
+    if (scan.m_ah)
+    {
+      if (pass == 2)
+        put_bits((pSrc[0] >> al) & 1, 1);
+      return;
+    }
+    const int dc = pSrc[0] >> al, diff = dc - m_last_dc_val[component_num];
+    m_last_dc_val[component_num] = dc;
+    const uint nbits = bit_length((diff < 0) ? -diff : diff);
+    put_symbol<pass>(component_num > 0, nbits);
+    if ((pass == 2) && (nbits))
+      put_bits(((diff < 0) ? (diff - 1) : diff) & ((1U << nbits) - 1), nbits);
+    return;
+  }
+
+  const int table_num = 2 + (component_num > 0);
+  if (!scan.m_ah)
+  {
+    uint run = 0;
+    for (int k = scan.m_ss; k <= scan.m_se; k++)
+    {
+      int temp = pSrc[k], temp2;
+      if (temp < 0) { temp = -temp >> al; temp2 = ~temp; } else { temp >>= al; temp2 = temp; }
+      if (!temp) { run++; continue; }
+      put_eob_run<pass>(table_num);
+      for ( ; run > 15; run -= 16)
+        put_symbol<pass>(table_num, 0xF0);
+      const uint nbits = bit_length(temp);
+      put_symbol<pass>(table_num, (run << 4) + nbits);
+      if (pass == 2)
+        put_bits(temp2 & ((1U << nbits) - 1), nbits);
+      run = 0;
+    }
+    if ((run) && (++m_eob_run == 0x7FFF))
+      put_eob_run<pass>(table_num);
+    return;
+  }
+
+  // Refinement: coefficients that become nonzero at this bit are coded like a first scan with magnitude 1; those already nonzero only
+  // contribute a correction bit, sent after the next symbol (or with the EOB run if none follows in this block).
+  int abs_values[64], eob = 0;
+  for (int k = scan.m_ss; k <= scan.m_se; k++)
+  {
+    abs_values[k] = ((pSrc[k] < 0) ? -pSrc[k] : pSrc[k]) >> al;
+    if (abs_values[k] == 1)
+      eob = k;
+  }
+  uint run = 0, num_block_bits = 0;
+  uint8 *pBlock_bits = m_correction_bits + m_num_correction_bits;
+  for (int k = scan.m_ss; k <= scan.m_se; k++)
+  {
+    const int temp = abs_values[k];
+    if (!temp) { run++; continue; }
+    while ((run > 15) && (k <= eob))
+    {
+      put_eob_run<pass>(table_num);
+      put_symbol<pass>(table_num, 0xF0);
+      run -= 16;
+      if (pass == 2)
+        for (uint i = 0; i < num_block_bits; i++)
+          put_bits(pBlock_bits[i], 1);
+      pBlock_bits = m_correction_bits; num_block_bits = 0;
+    }
+    if (temp > 1)
+    {
+      pBlock_bits[num_block_bits++] = static_cast<uint8>(temp & 1);
+      continue;
+    }
+    put_eob_run<pass>(table_num);
+    put_symbol<pass>(table_num, (run << 4) + 1);
+    if (pass == 2)
+    {
+      put_bits((pSrc[k] < 0) ? 0 : 1, 1);
+      for (uint i = 0; i < num_block_bits; i++)
+        put_bits(pBlock_bits[i], 1);
+    }
+    pBlock_bits = m_correction_bits; num_block_bits = 0;
+    run = 0;
+  }
+  if ((run) || (num_block_bits))
+  {
+    m_eob_run++;
+    m_num_correction_bits += num_block_bits;
+    if ((m_eob_run == 0x7FFF) || (m_num_correction_bits > MAX_CORRECTION_BITS - 64 + 1))
+      put_eob_run<pass>(table_num);
+  }
+}
+
+// Interleaved (DC) scans visit the buffered blocks in MCU order. Single-component scans visit only that component's blocks, in raster order
+// over the component's own dimensions, which excludes the MCU padding.
+template<int pass> void jpeg_encoder::code_progressive_scan(const progressive_scan &scan)
+{
+  memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+  m_eob_run = 0; m_num_correction_bits = 0;
+  if (scan.m_num_comps > 1)
+  {
+    const uint8 *pComponents = s_mcu_components[m_params.m_subsampling];
+    const int16 *pSrc = m_pCoefficient_buffer;
+    for (uint i = 0; i < m_num_buffered_blocks; i += m_blocks_per_mcu)
+      for (int j = 0; j < m_blocks_per_mcu; j++, pSrc += 64)
+        code_progressive_block<pass>(pSrc, pComponents[j], scan);
+    return;
+  }
+
+  const int c = scan.m_comps[0], h = m_comp_h_samp[c], v = m_comp_v_samp[c];
+  const int blocks_x = ((m_image_x * h + m_comp_h_samp[0] - 1) / m_comp_h_samp[0] + 7) >> 3;
+  const int blocks_y = ((m_image_y * v + m_comp_v_samp[0] - 1) / m_comp_v_samp[0] + 7) >> 3;
+  const int first_block = c ? (m_comp_h_samp[0] * m_comp_v_samp[0] + c - 1) : 0;
+  for (int by = 0; by < blocks_y; by++)
+  {
+    for (int bx = 0; bx < blocks_x; bx++)
+    {
+      const int mcu = (by / v) * m_mcus_per_row + (bx / h);
+      code_progressive_block<pass>(m_pCoefficient_buffer + (mcu * m_blocks_per_mcu + first_block + (by % v) * h + (bx % h)) * 64, c, scan);
+    }
+  }
+  if (scan.m_ss)
+    put_eob_run<pass>(2 + (c > 0));
+}
+
+// Writes the whole progressive file from the coefficient buffer. Every scan is coded twice: once to count its symbols so it gets its own
+// optimized tables, and once to output it.
+bool jpeg_encoder::code_progressive_scans()
+{
+  emit_marker(M_SOI);
+  emit_jfif_app0();
+  emit_dqt();
+  emit_sof();
+
+  const progressive_scan *pScans = (m_num_components == 3) ? s_ycc_scans : s_grey_scans;
+  const int num_scans = (m_num_components == 3) ? (int)(sizeof(s_ycc_scans) / sizeof(s_ycc_scans[0])) : (int)(sizeof(s_grey_scans) / sizeof(s_grey_scans[0]));
+  for (int i = 0; i < num_scans; i++)
+  {
+    const progressive_scan &scan = pScans[i];
+    if ((scan.m_ss) || (!scan.m_ah))
+    {
+      clear_obj(m_huff_count);
+      code_progressive_scan<1>(scan);
+      uint used_tables = 0;
+      for (int j = 0; j < scan.m_num_comps; j++)
+        used_tables |= 1 << ((scan.m_ss ? 2 : 0) + (scan.m_comps[j] > 0));
+      for (int t = 0; t < 4; t++)
+      {
+        if (!(used_tables & (1 << t)))
+          continue;
+        optimize_huffman_table(t, (t >= 2) ? AC_LUM_CODES : DC_LUM_CODES);
+        compute_huffman_table(&m_huff_codes[t][0], m_huff_bits[t], m_huff_val[t]);
+        emit_dht(m_huff_bits[t], m_huff_val[t], t & 1, t >= 2);
+      }
+    }
+    emit_sos(scan.m_num_comps, scan.m_comps, scan.m_ss, scan.m_se, scan.m_ah, scan.m_al);
+    m_bit_buffer = 0; m_bits_in = 0;
+    code_progressive_scan<2>(scan);
+    put_bits(0x7F, 7);
+    flush_bits();
+  }
+
+  emit_marker(M_EOI);
+  flush_output_buffer();
+  m_pass_num = 3;
+  return m_all_stream_writes_succeeded;
 }
 
 bool jpeg_encoder::terminate_pass_one()
@@ -740,8 +1662,10 @@ bool jpeg_encoder::terminate_pass_one()
 bool jpeg_encoder::terminate_pass_two()
 {
   put_bits(0x7F, 7);
+  flush_bits();
+  if (!m_strip_flag)
+    emit_marker(M_EOI);
   flush_output_buffer();
-  emit_marker(M_EOI);
   m_pass_num++;
   return true;
 }
@@ -760,9 +1684,19 @@ bool jpeg_encoder::process_end_of_image()
   }
 
   if (m_pass_num == 1)
-    return terminate_pass_one();
-  else
-    return terminate_pass_two();
+  {
+    // A strip's pass one ends here; compress_image_to_jpeg_file_in_memory_mt() merges the statistics and starts pass two.
+    if ((m_strip_flag) || (m_pDCT_cache))
+      return true;
+    if (m_params.m_progressive_flag)
+      return code_progressive_scans();
+    if (!terminate_pass_one())
+      return false;
+    if (!m_pCoefficient_buffer)
+      return true;
+    code_buffered_coefficients();
+  }
+  return terminate_pass_two();
 }
 
 void jpeg_encoder::load_mcu(const void *pSrc)
@@ -773,33 +1707,33 @@ void jpeg_encoder::load_mcu(const void *pSrc)
 
   if (m_num_components == 1)
   {
-    if (m_image_bpp == 4)
-      RGBA_to_Y(pDst, Psrc, m_image_x);
-    else if (m_image_bpp == 3)
-      RGB_to_Y(pDst, Psrc, m_image_x);
-    else
-      memcpy(pDst, Psrc, m_image_x);
+    switch (m_pixel_format)
+    {
+      case PIXEL_RGB:  RGB_to_Y<3, false>(pDst, Psrc, m_image_x); break;
+      case PIXEL_RGBX: RGB_to_Y<4, false>(pDst, Psrc, m_image_x); break;
+      case PIXEL_BGR:  RGB_to_Y<3, true>(pDst, Psrc, m_image_x); break;
+      case PIXEL_BGRX: RGB_to_Y<4, true>(pDst, Psrc, m_image_x); break;
+      default:         memcpy(pDst, Psrc, m_image_x); break;
+    }
   }
   else
   {
-    if (m_image_bpp == 4)
-      RGBA_to_YCC(pDst, Psrc, m_image_x);
-    else if (m_image_bpp == 3)
-      RGB_to_YCC(pDst, Psrc, m_image_x);
-    else
-      Y_to_YCC(pDst, Psrc, m_image_x);
+    switch (m_pixel_format)
+    {
+      case PIXEL_RGB:  RGB_to_YCC<3, false>(pDst, m_plane_bpl, Psrc, m_image_x); break;
+      case PIXEL_RGBX: RGB_to_YCC<4, false>(pDst, m_plane_bpl, Psrc, m_image_x); break;
+      case PIXEL_BGR:  RGB_to_YCC<3, true>(pDst, m_plane_bpl, Psrc, m_image_x); break;
+      case PIXEL_BGRX: RGB_to_YCC<4, true>(pDst, m_plane_bpl, Psrc, m_image_x); break;
+      default:         Y_to_YCC(pDst, m_plane_bpl, Psrc, m_image_x); break;
+    }
   }
 
-  if (m_num_components == 1)
-    memset(m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt, pDst[m_image_bpl_xlt - 1], m_image_x_mcu - m_image_x);
-  else
+  // Replicate the last pixel of each plane out to the MCU boundary, and one sample past either end of the chroma planes for the filtered downsampler.
+  for (int c = 0; c < m_num_components; c++, pDst += m_plane_bpl)
   {
-    const uint8 y = pDst[m_image_bpl_xlt - 3 + 0], cb = pDst[m_image_bpl_xlt - 3 + 1], cr = pDst[m_image_bpl_xlt - 3 + 2];
-    uint8 *q = m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt;
-    for (int i = m_image_x; i < m_image_x_mcu; i++)
-    {
-      *q++ = y; *q++ = cb; *q++ = cr;
-    }
+    memset(pDst + m_image_x, pDst[m_image_x - 1], m_image_x_mcu - m_image_x + 1);
+    if (c)
+      pDst[-1] = pDst[0];
   }
 
   if (++m_mcu_y_ofs == m_mcu_y)
@@ -809,15 +1743,53 @@ void jpeg_encoder::load_mcu(const void *pSrc)
   }
 }
 
+// Copies a row of width samples into an MCU line plane, replicating the last sample out to padded_width.
+static inline void load_planar_row(uint8 *pDst, const uint8 *pSrc, int width, int padded_width)
+{
+  memcpy(pDst, pSrc, width);
+  memset(pDst + width, pSrc[width - 1], padded_width - width);
+}
+
+bool jpeg_encoder::process_planar_image(const uint8 *pY, int y_stride, const uint8 *pCb, int cb_stride, const uint8 *pCr, int cr_stride)
+{
+  if ((m_pass_num < 1) || (m_pass_num > 2) || (m_mcu_y_ofs) || (!pY) || ((m_num_components > 1) && ((!pCb) || (!pCr)))) return false;
+
+  // Chroma rows are stored at the start of the MCU lines' chroma planes, m_mcu_y / v of them per MCU row.
+  const int h = m_comp_h_samp[0], v = m_comp_v_samp[0];
+  const int chroma_x = (m_image_x + h - 1) / h, chroma_y = (m_image_y + v - 1) / v;
+  const uint8 *pChroma[2] = { pCb, pCr };
+  const int chroma_strides[2] = { cb_stride, cr_stride };
+  for (int y = 0; (y < m_image_y_mcu) && (m_all_stream_writes_succeeded); y += m_mcu_y)
+  {
+    for (int i = 0; i < m_mcu_y; i++)
+      load_planar_row(m_mcu_lines[i], pY + JPGE_MIN(y + i, m_image_y - 1) * static_cast<ptrdiff_t>(y_stride), m_image_x, m_image_x_mcu);
+    for (int c = 1; c < m_num_components; c++)
+      for (int i = 0; i < m_mcu_y / v; i++)
+        load_planar_row(m_mcu_lines[i] + c * m_plane_bpl, pChroma[c - 1] + JPGE_MIN(y / v + i, chroma_y - 1) * static_cast<ptrdiff_t>(chroma_strides[c - 1]), chroma_x, m_image_x_mcu / h);
+    process_mcu_row(true);
+  }
+  return m_all_stream_writes_succeeded && process_end_of_image() && m_all_stream_writes_succeeded;
+}
+
 void jpeg_encoder::clear()
 {
-  m_mcu_lines[0] = NULL;
+  m_pCoefficient_buffer = NULL;
+  m_pDCT_cache = NULL;
+  m_strip_flag = false;
+  m_strip_first_interval = 0;
   m_pass_num = 0;
   m_all_stream_writes_succeeded = true;
 }
 
 jpeg_encoder::jpeg_encoder()
 {
+  m_mcu_lines[0] = NULL;
+  m_mcu_lines_size = 0;
+  m_cached_quality = -1;
+  m_cached_no_chroma_discrim_flag = false;
+  m_std_huff_tables_flag = false;
+  m_header_cache_size = 0;
+  m_omit_dht_flag = false;
   clear();
 }
 
@@ -828,16 +1800,63 @@ jpeg_encoder::~jpeg_encoder()
 
 bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params)
 {
-  deinit();
-  if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
+  if ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) return false;
+  return init_strip(pStream, width, height, (src_channels == 1) ? PIXEL_Y : ((src_channels == 3) ? PIXEL_RGB : PIXEL_RGBX), comp_params, false, 0);
+}
+
+bool jpeg_encoder::init(output_stream *pStream, int width, int height, pixel_format_t pixel_format, const params &comp_params)
+{
+  return init_strip(pStream, width, height, pixel_format, comp_params, false, 0);
+}
+
+// A strip encoder codes a band of a larger image's rows that starts at restart interval first_interval. It writes no headers or EOI, opens with
+// the RST marker preceding its first interval, and in two-pass mode stops after pass one until begin_strip_pass_two() hands it the merged tables.
+bool jpeg_encoder::init_strip(output_stream *pStream, int width, int height, pixel_format_t pixel_format, const params &comp_params, bool strip_flag, uint first_interval)
+{
+  reset();
+  if (((!pStream) || (width < 1) || (height < 1)) || ((uint)pixel_format > (uint)PIXEL_BGRX) || (!comp_params.check())) return false;
   m_pStream = pStream;
   m_params = comp_params;
-  return jpg_open(width, height, src_channels);
+  m_strip_flag = strip_flag;
+  m_strip_first_interval = first_interval;
+  return jpg_open(width, height, pixel_format);
+}
+
+bool jpeg_encoder::begin_strip_pass_two(const jpeg_encoder &master)
+{
+  memcpy(m_huff_bits, master.m_huff_bits, sizeof(m_huff_bits));
+  memcpy(m_huff_val, master.m_huff_val, sizeof(m_huff_val));
+  m_std_huff_tables_flag = false;
+  if (!second_pass_init()) return false;
+  if (m_pCoefficient_buffer)
+  {
+    code_buffered_coefficients();
+    terminate_pass_two();
+  }
+  return m_all_stream_writes_succeeded;
+}
+
+bool jpeg_encoder::process_image(const image_desc &image)
+{
+  for (int i = 0; i < m_image_y; i++)
+    if (!process_scanline(image.get_row(i)))
+      return false;
+  return process_scanline(NULL);
 }
 
 void jpeg_encoder::deinit()
 {
   jpge_free(m_mcu_lines[0]);
+  m_mcu_lines[0] = NULL;
+  m_mcu_lines_size = 0;
+  reset();
+}
+
+// Frees the buffers sized by the whole image, keeping the MCU lines and derived tables for the next init().
+void jpeg_encoder::reset()
+{
+  jpge_free(m_pCoefficient_buffer);
+  jpge_free(m_pDCT_cache);
   clear();
 }
 
@@ -858,18 +1877,97 @@ bool jpeg_encoder::process_scanline(const void* pScanline)
   return m_all_stream_writes_succeeded;
 }
 
+image_desc::image_desc(const void *pPixels, int width, int height, int num_channels) :
+  m_pPixels(((num_channels == 1) || (num_channels == 3) || (num_channels == 4)) ? pPixels : NULL),
+  m_format((num_channels == 1) ? PIXEL_Y : ((num_channels == 3) ? PIXEL_RGB : PIXEL_RGBX)),
+  m_stride(width * num_channels), m_x(0), m_y(0), m_width(width), m_height(height)
+{
+}
+
+bool image_desc::check() const
+{
+  return (m_pPixels) && ((uint)m_format <= (uint)PIXEL_BGRX) && (m_width >= 1) && (m_height >= 1) && (m_x >= 0) && (m_y >= 0);
+}
+
+static const int s_bytes_per_pixel[] = { 1, 3, 4, 3, 4 };
+
+const uint8 *image_desc::get_row(int row) const
+{
+  return static_cast<const uint8*>(m_pPixels) + (m_y + row) * static_cast<ptrdiff_t>(m_stride) + m_x * s_bytes_per_pixel[m_format];
+}
+
+// True when every pixel has R == G == B. Stops at the first row that doesn't.
+static bool is_grayscale(const image_desc &image)
+{
+  const int bpp = ((image.m_format == PIXEL_RGB) || (image.m_format == PIXEL_BGR)) ? 3 : 4, n = image.m_width * bpp;
+  for (int y = 0; y < image.m_height; y++)
+  {
+    const uint8 *p = image.get_row(y);
+    int i = 0;
+#if JPGE_USE_SSE2
+    // Each byte of the first two channels must equal the byte after it; the masks pick those lanes out of each 16 (RGBX) or 48 (RGB) bytes.
+    uint diff = 0;
+    if (bpp == 4)
+    {
+      for ( ; i + 17 <= n; i += 16)
+        diff |= ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 1)))) & 0x3333;
+    }
+    else
+    {
+      for ( ; i + 49 <= n; i += 48)
+      {
+        static const uint s_masks[3] = { 0xB6DB, 0xDB6D, 0x6DB6 };
+        for (int k = 0; k < 3; k++)
+          diff |= ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + k * 16)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + k * 16 + 1)))) & s_masks[k];
+      }
+    }
+    if (diff)
+      return false;
+#endif
+    for ( ; i < n; i += bpp)
+      if ((p[i] != p[i + 1]) || (p[i + 1] != p[i + 2]))
+        return false;
+  }
+  return true;
+}
+
+// With m_auto_grayscale_flag, color images that turn out to be gray are coded as Y_ONLY, which has the same luma and no chroma.
+static bool code_as_grayscale(const image_desc &image, const params &comp_params)
+{
+  return (comp_params.m_auto_grayscale_flag) && (comp_params.m_subsampling != Y_ONLY) && (image.m_format != PIXEL_Y) && (is_grayscale(image));
+}
+
+static params grayscale_params(const params &comp_params)
+{
+  params gray_params(comp_params);
+  gray_params.m_subsampling = Y_ONLY;
+  return gray_params;
+}
+
 #include <stdio.h>
 
+// Coded data is written straight into a 64KB buffer and goes to the file in buffer sized writes.
 class cfile_stream : public output_stream
 {
    cfile_stream(const cfile_stream &);
    cfile_stream &operator= (const cfile_stream &);
 
+   enum { BUF_SIZE = 65536 };
+
    FILE* m_pFile;
    bool m_bStatus;
+   uint8 *m_pBuf;
+   uint m_buf_ofs;
+
+   bool write_buffered()
+   {
+      m_bStatus = m_bStatus && ((!m_buf_ofs) || (fwrite(m_pBuf, m_buf_ofs, 1, m_pFile) == 1));
+      m_buf_ofs = 0;
+      return m_bStatus;
+   }
 
 public:
-   cfile_stream() : m_pFile(NULL), m_bStatus(false) { }
+   cfile_stream() : m_pFile(NULL), m_bStatus(false), m_pBuf(NULL), m_buf_ofs(0) { }
 
    virtual ~cfile_stream()
    {
@@ -881,6 +1979,8 @@ public:
       close();
       m_pFile = fopen(pFilename, "wb");
       m_bStatus = (m_pFile != NULL);
+      if ((m_bStatus) && (!m_pBuf))
+         m_pBuf = static_cast<uint8*>(jpge_malloc(BUF_SIZE));
       return m_bStatus;
    }
 
@@ -888,112 +1988,1557 @@ public:
    {
       if (m_pFile)
       {
+         write_buffered();
          if (fclose(m_pFile) == EOF)
          {
             m_bStatus = false;
          }
          m_pFile = NULL;
       }
+      jpge_free(m_pBuf);
+      m_pBuf = NULL;
       return m_bStatus;
    }
 
    virtual bool put_buf(const void* pBuf, int len)
    {
-      m_bStatus = m_bStatus && (fwrite(pBuf, len, 1, m_pFile) == 1);
+      if ((m_pBuf) && ((uint)len <= BUF_SIZE - m_buf_ofs))
+      {
+         memcpy(m_pBuf + m_buf_ofs, pBuf, len);
+         m_buf_ofs += len;
+         return m_bStatus;
+      }
+      m_bStatus = write_buffered() && (fwrite(pBuf, len, 1, m_pFile) == 1);
       return m_bStatus;
    }
 
-   uint get_size() const
+   virtual uint8 *get_write_window(uint min_len, uint &avail_len)
    {
-      return m_pFile ? ftell(m_pFile) : 0;
+      avail_len = 0;
+      if ((!m_pBuf) || (min_len > BUF_SIZE) || ((BUF_SIZE - m_buf_ofs < min_len) && (!write_buffered())))
+         return NULL;
+      avail_len = BUF_SIZE - m_buf_ofs;
+      return m_pBuf + m_buf_ofs;
    }
-};
-
-bool compress_image_to_jpeg_file(const char *pFilename, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
-{
-  cfile_stream dst_stream;
-  if (!dst_stream.open(pFilename))
-    return false;
-
-  jpge::jpeg_encoder dst_image;
-  if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
-    return false;
-
-  for (uint pass_index = 0; pass_index < dst_image.get_total_passes(); pass_index++)
-  {
-    for (int i = 0; i < height; i++)
-    {
-       const uint8* pBuf = pImage_data + i * width * num_channels;
-       if (!dst_image.process_scanline(pBuf))
-          return false;
-    }
-    if (!dst_image.process_scanline(NULL))
-       return false;
-  }
-
-  dst_image.deinit();
-
-  return dst_stream.close();
-}
-
-class memory_stream : public output_stream
-{
-   memory_stream(const memory_stream &);
-   memory_stream &operator= (const memory_stream &);
-
-   uint8 *m_pBuf;
-   uint m_buf_size, m_buf_ofs;
-
-public:
-   memory_stream(void *pBuf, uint buf_size) : m_pBuf(static_cast<uint8*>(pBuf)), m_buf_size(buf_size), m_buf_ofs(0) { }
-
-   virtual ~memory_stream() { }
 
-   virtual bool put_buf(const void* pBuf, int len)
+   virtual bool commit(uint len)
    {
-      uint buf_remaining = m_buf_size - m_buf_ofs;
-      if ((uint)len > buf_remaining)
+      if ((!m_pBuf) || (len > BUF_SIZE - m_buf_ofs))
          return false;
-      memcpy(m_pBuf + m_buf_ofs, pBuf, len);
       m_buf_ofs += len;
-      return true;
+      return m_bStatus;
    }
 
    uint get_size() const
    {
-      return m_buf_ofs;
+      return m_pFile ? (ftell(m_pFile) + m_buf_ofs) : 0;
    }
 };
 
-bool compress_image_to_jpeg_file_in_memory(void *pDstBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
+// The writer owns the file and every buffer. Buffers cycle from the free list to the stream, through the queue to the writer thread, and
+// back; with max_queued_bufs + 2 of them the stream never waits for a free one.
+struct async_file_stream::writer
 {
-   if ((!pDstBuf) || (!buf_size))
-      return false;
-
-   memory_stream dst_stream(pDstBuf, buf_size);
-
-   buf_size = 0;
-
-   jpge::jpeg_encoder dst_image;
-   if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
-      return false;
+   FILE *m_pFile;
+   int m_fd;
+   bool m_error;
+   uint m_buf_size, m_max_queued;
+   uint8 **m_pBufs;
+   uint m_num_bufs, m_num_free;
+   uint8 **m_pFree;
+   uint8 **m_pQueue;
+   uint *m_pQueue_len;
+   uint m_queue_head, m_queue_count;
+#if JPGE_USE_THREADS
+   std::mutex m_mutex;
+   std::condition_variable m_work_cond, m_space_cond;
+   std::thread m_thread;
+   bool m_started, m_closing;
+#endif
+
+   writer(uint buf_size, uint max_queued) : m_pFile(NULL), m_fd(-1), m_error(false), m_buf_size(buf_size), m_max_queued(max_queued), m_num_bufs(0), m_num_free(0), m_queue_head(0), m_queue_count(0)
+   {
+      m_pBufs = new uint8*[max_queued + 2];
+      m_pFree = new uint8*[max_queued + 2];
+      m_pQueue = new uint8*[max_queued];
+      m_pQueue_len = new uint[max_queued];
+#if JPGE_USE_THREADS
+      m_started = m_closing = false;
+#endif
+   }
 
-   for (uint pass_index = 0; pass_index < dst_image.get_total_passes(); pass_index++)
+   ~writer()
    {
-     for (int i = 0; i < height; i++)
-     {
-        const uint8* pScanline = pImage_data + i * width * num_channels;
-        if (!dst_image.process_scanline(pScanline))
-           return false;
-     }
-     if (!dst_image.process_scanline(NULL))
-        return false;
+      for (uint i = 0; i < m_num_bufs; i++)
+         jpge_free(m_pBufs[i]);
+      delete[] m_pBufs;
+      delete[] m_pFree;
+      delete[] m_pQueue;
+      delete[] m_pQueue_len;
    }
 
-   dst_image.deinit();
+   bool open(const char *pFilename, bool direct_io)
+   {
+#if defined(__linux__) && defined(O_DIRECT)
+      if (direct_io)
+      {
+         m_fd = ::open(pFilename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+         if (m_fd >= 0)
+            return true;
+      }
+#else
+      (void)direct_io;
+#endif
+      m_pFile = fopen(pFilename, "wb");
+      if (m_pFile)
+         setvbuf(m_pFile, NULL, _IONBF, 0);
+      return m_pFile != NULL;
+   }
 
+   // Called with the mutex held, or before the thread starts.
+   uint8 *alloc_buf()
+   {
+      if (m_num_free)
+         return m_pFree[--m_num_free];
+      if (m_num_bufs == m_max_queued + 2)
+         return NULL;
+      void *p = NULL;
+#if defined(__linux__) && defined(O_DIRECT)
+      if (m_fd >= 0)
+      {
+         if (posix_memalign(&p, 4096, m_buf_size))
+            p = NULL;
+      }
+      else
+#endif
+         p = jpge_malloc(m_buf_size);
+      if (p)
+         m_pBufs[m_num_bufs++] = static_cast<uint8*>(p);
+      return static_cast<uint8*>(p);
+   }
+
+   bool write(const uint8 *pBuf, uint len)
+   {
+#if defined(__linux__) && defined(O_DIRECT)
+      if (m_fd >= 0)
+      {
+         // Only the file's last buffer can be partial; O_DIRECT is dropped for its unaligned tail.
+         uint aligned_len = len & ~4095U;
+         while (len)
+         {
+            if (!aligned_len)
+            {
+               const int flags = fcntl(m_fd, F_GETFL);
+               if ((flags == -1) || (fcntl(m_fd, F_SETFL, flags & ~O_DIRECT) == -1))
+                  return false;
+               aligned_len = len;
+            }
+            const ssize_t n = ::write(m_fd, pBuf, aligned_len);
+            if (n <= 0)
+               return false;
+            pBuf += n; len -= static_cast<uint>(n); aligned_len -= static_cast<uint>(n);
+         }
+         return true;
+      }
+#endif
+      return (!len) || (fwrite(pBuf, len, 1, m_pFile) == 1);
+   }
+
+#if JPGE_USE_THREADS
+   void run()
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      for ( ; ; )
+      {
+         while ((!m_queue_count) && (!m_closing))
+            m_work_cond.wait(lock);
+         if (!m_queue_count)
+            break;
+         uint8 *pBuf = m_pQueue[m_queue_head];
+         const uint len = m_pQueue_len[m_queue_head];
+         lock.unlock();
+         const bool status = write(pBuf, len);
+         lock.lock();
+         m_error = m_error || !status;
+         m_queue_head = (m_queue_head + 1) % m_max_queued;
+         m_queue_count--;
+         m_pFree[m_num_free++] = pBuf;
+         m_space_cond.notify_one();
+      }
+   }
+#endif
+
+   // Hands pBuf over for writing and returns the buffer to fill next, or NULL once a write has failed.
+   uint8 *queue(uint8 *pBuf, uint len)
+   {
+#if JPGE_USE_THREADS
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (!m_started)
+      {
+         m_started = true;
+         // If the thread can't be created the buffers are written synchronously, as without JPGE_USE_THREADS.
+         try
+         {
+            m_thread = std::thread(&writer::run, this);
+         }
+         catch (const std::system_error &)
+         {
+         }
+      }
+      if (m_thread.joinable())
+      {
+         while ((m_queue_count == m_max_queued) && (!m_error))
+            m_space_cond.wait(lock);
+         if (m_error)
+            return NULL;
+         const uint i = (m_queue_head + m_queue_count++) % m_max_queued;
+         m_pQueue[i] = pBuf;
+         m_pQueue_len[i] = len;
+         m_work_cond.notify_one();
+         return alloc_buf();
+      }
+#endif
+      if ((m_error) || (!write(pBuf, len)))
+      {
+         m_error = true;
+         return NULL;
+      }
+      return pBuf;
+   }
+
+   bool close(const uint8 *pLast_buf, uint len)
+   {
+#if JPGE_USE_THREADS
+      if (m_thread.joinable())
+      {
+         {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closing = true;
+            m_work_cond.notify_one();
+         }
+         m_thread.join();
+      }
+#endif
+      m_error = m_error || !write(pLast_buf, len);
+      if (m_pFile)
+         m_error = (fclose(m_pFile) == EOF) || m_error;
+#if defined(__linux__)
+      if (m_fd >= 0)
+         m_error = (::close(m_fd) != 0) || m_error;
+#endif
+      m_pFile = NULL;
+      m_fd = -1;
+      return !m_error;
+   }
+};
+
+async_file_stream::async_file_stream() : m_pWriter(NULL), m_pBuf(NULL), m_buf_size(0), m_buf_ofs(0) { }
+
+async_file_stream::~async_file_stream()
+{
+   close();
+}
+
+bool async_file_stream::open(const char *pFilename, bool direct_io, uint buf_size, uint max_queued_bufs)
+{
+   close();
+   m_buf_size = JPGE_MAX((buf_size + 4095U) & ~4095U, 4096U);
+   m_pWriter = new writer(m_buf_size, JPGE_MAX(max_queued_bufs, 1U));
+   if ((!m_pWriter->open(pFilename, direct_io)) || ((m_pBuf = m_pWriter->alloc_buf()) == NULL))
+   {
+      m_pWriter->close(NULL, 0);
+      delete m_pWriter;
+      m_pWriter = NULL;
+      return false;
+   }
+   return true;
+}
+
+bool async_file_stream::close()
+{
+   if (!m_pWriter)
+      return false;
+   const bool status = m_pWriter->close(m_pBuf, m_pBuf ? m_buf_ofs : 0) && (m_pBuf != NULL);
+   delete m_pWriter;
+   m_pWriter = NULL;
+   m_pBuf = NULL;
+   m_buf_ofs = 0;
+   return status;
+}
+
+// Only full buffers are queued, so with O_DIRECT every write but the last is aligned.
+bool async_file_stream::queue_buf()
+{
+   m_pBuf = m_pWriter->queue(m_pBuf, m_buf_size);
+   m_buf_ofs = 0;
+   return m_pBuf != NULL;
+}
+
+bool async_file_stream::put_buf(const void* pBuf, int len)
+{
+   if (!m_pBuf)
+      return false;
+   const uint8 *pSrc = static_cast<const uint8*>(pBuf);
+   while (len)
+   {
+      const uint n = JPGE_MIN(static_cast<uint>(len), m_buf_size - m_buf_ofs);
+      memcpy(m_pBuf + m_buf_ofs, pSrc, n);
+      pSrc += n; len -= n;
+      if (((m_buf_ofs += n) == m_buf_size) && (!queue_buf()))
+         return false;
+   }
+   return true;
+}
+
+uint8 *async_file_stream::get_write_window(uint min_len, uint &avail_len)
+{
+   avail_len = 0;
+   if ((!m_pBuf) || (m_buf_size - m_buf_ofs < min_len))
+      return NULL;
+   avail_len = m_buf_size - m_buf_ofs;
+   return m_pBuf + m_buf_ofs;
+}
+
+bool async_file_stream::commit(uint len)
+{
+   if ((!m_pBuf) || (len > m_buf_size - m_buf_ofs))
+      return false;
+   m_buf_ofs += len;
+   return (m_buf_ofs < m_buf_size) || queue_buf();
+}
+
+#if JPGE_USE_THREADS
+// Idle encoders of the current thread, deleted when it exits.
+struct encoder_pool
+{
+   enum { MAX_ENCODERS = 4 };
+   jpeg_encoder *m_pEncoders[MAX_ENCODERS];
+   uint m_num_encoders;
+
+   encoder_pool() : m_num_encoders(0) { }
+   ~encoder_pool()
+   {
+      while (m_num_encoders)
+         delete m_pEncoders[--m_num_encoders];
+   }
+};
+
+static thread_local encoder_pool g_encoder_pool;
+#endif
+
+jpeg_encoder *borrow_encoder()
+{
+#if JPGE_USE_THREADS
+   if (g_encoder_pool.m_num_encoders)
+      return g_encoder_pool.m_pEncoders[--g_encoder_pool.m_num_encoders];
+#endif
+   return new jpeg_encoder;
+}
+
+void return_encoder(jpeg_encoder *pEncoder)
+{
+   if (!pEncoder)
+      return;
+   pEncoder->reset();
+#if JPGE_USE_THREADS
+   if (g_encoder_pool.m_num_encoders < encoder_pool::MAX_ENCODERS)
+   {
+      g_encoder_pool.m_pEncoders[g_encoder_pool.m_num_encoders++] = pEncoder;
+      return;
+   }
+#endif
+   delete pEncoder;
+}
+
+// Holds a borrowed encoder for the length of a compress_*() call.
+class pooled_encoder
+{
+   pooled_encoder(const pooled_encoder &);
+   pooled_encoder &operator= (const pooled_encoder &);
+
+   jpeg_encoder *m_pEncoder;
+
+public:
+   pooled_encoder() : m_pEncoder(borrow_encoder()) { }
+   ~pooled_encoder() { return_encoder(m_pEncoder); }
+
+   jpeg_encoder *operator->() const { return m_pEncoder; }
+};
+
+bool compress_image_to_jpeg_file(const char *pFilename, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
+{
+  return compress_image_to_jpeg_file(pFilename, image_desc(pImage_data, width, height, num_channels), comp_params);
+}
+
+// Runs every pass of the image through a pooled encoder into pStream.
+static bool compress_image_to_stream(output_stream *pStream, const image_desc &image, const params &comp_params)
+{
+  pooled_encoder dst_image;
+  if (!dst_image->init(pStream, image.m_width, image.m_height, image.m_format, comp_params))
+    return false;
+
+  for (uint pass_index = 0; pass_index < dst_image->get_total_passes(); pass_index++)
+  {
+    for (int i = 0; i < image.m_height; i++)
+    {
+       if (!dst_image->process_scanline(image.get_row(i)))
+          return false;
+    }
+    if (!dst_image->process_scanline(NULL))
+       return false;
+  }
+  return true;
+}
+
+bool compress_image_to_jpeg_file(const char *pFilename, const image_desc &image, const params &comp_params)
+{
+  if (!image.check())
+    return false;
+  if (code_as_grayscale(image, comp_params))
+    return compress_image_to_jpeg_file(pFilename, image, grayscale_params(comp_params));
+
+  cfile_stream dst_stream;
+  if (!dst_stream.open(pFilename))
+    return false;
+
+  return (compress_image_to_stream(&dst_stream, image, comp_params)) && (dst_stream.close());
+}
+
+bool compress_image_to_jpeg_file_async(const char *pFilename, const image_desc &image, const params &comp_params, bool direct_io)
+{
+  if (!image.check())
+    return false;
+  if (code_as_grayscale(image, comp_params))
+    return compress_image_to_jpeg_file_async(pFilename, image, grayscale_params(comp_params), direct_io);
+
+  async_file_stream dst_stream;
+  if (!dst_stream.open(pFilename, direct_io))
+    return false;
+
+  return (compress_image_to_stream(&dst_stream, image, comp_params)) && (dst_stream.close());
+}
+
+class memory_stream : public output_stream
+{
+   memory_stream(const memory_stream &);
+   memory_stream &operator= (const memory_stream &);
+
+   uint8 *m_pBuf;
+   uint m_buf_size, m_buf_ofs;
+
+public:
+   memory_stream(void *pBuf, uint buf_size) : m_pBuf(static_cast<uint8*>(pBuf)), m_buf_size(buf_size), m_buf_ofs(0) { }
+
+   virtual ~memory_stream() { }
+
+   virtual bool put_buf(const void* pBuf, int len)
+   {
+      uint buf_remaining = m_buf_size - m_buf_ofs;
+      if ((uint)len > buf_remaining)
+         return false;
+      memcpy(m_pBuf + m_buf_ofs, pBuf, len);
+      m_buf_ofs += len;
+      return true;
+   }
+
+   // The encoder writes the file in place.
+   virtual uint8 *get_write_window(uint min_len, uint &avail_len)
+   {
+      avail_len = m_buf_size - m_buf_ofs;
+      return (avail_len >= min_len) ? (m_pBuf + m_buf_ofs) : NULL;
+   }
+
+   virtual bool commit(uint len)
+   {
+      if (len > m_buf_size - m_buf_ofs)
+         return false;
+      m_buf_ofs += len;
+      return true;
+   }
+
+   uint get_size() const
+   {
+      return m_buf_ofs;
+   }
+};
+
+bool compress_image_to_jpeg_file_in_memory(void *pDstBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
+{
+   return compress_image_to_jpeg_file_in_memory(pDstBuf, buf_size, image_desc(pImage_data, width, height, num_channels), comp_params);
+}
+
+bool compress_image_to_jpeg_file_in_memory(void *pDstBuf, int &buf_size, const image_desc &image, const params &comp_params)
+{
+   if ((!pDstBuf) || (!buf_size) || (!image.check()))
+      return false;
+   if (code_as_grayscale(image, comp_params))
+      return compress_image_to_jpeg_file_in_memory(pDstBuf, buf_size, image, grayscale_params(comp_params));
+
+   memory_stream dst_stream(pDstBuf, buf_size);
+
+   buf_size = 0;
+
+   pooled_encoder dst_image;
+   if (!dst_image->init(&dst_stream, image.m_width, image.m_height, image.m_format, comp_params))
+      return false;
+
+   for (uint pass_index = 0; pass_index < dst_image->get_total_passes(); pass_index++)
+   {
+     for (int i = 0; i < image.m_height; i++)
+     {
+        if (!dst_image->process_scanline(image.get_row(i)))
+           return false;
+     }
+     if (!dst_image->process_scanline(NULL))
+        return false;
+   }
+
+   buf_size = dst_stream.get_size();
+   return true;
+}
+
+bool compress_planar_image_to_jpeg_file_in_memory(void *pDstBuf, int &buf_size, int width, int height, const uint8 *pY, int y_stride, const uint8 *pCb, int cb_stride, const uint8 *pCr, int cr_stride, const params &comp_params)
+{
+   if ((!pDstBuf) || (!buf_size))
+      return false;
+
+   memory_stream dst_stream(pDstBuf, buf_size);
+
+   buf_size = 0;
+
+   pooled_encoder dst_image;
+   if (!dst_image->init(&dst_stream, width, height, 3, comp_params))
+      return false;
+
+   for (uint pass_index = 0; pass_index < dst_image->get_total_passes(); pass_index++)
+   {
+     if (!dst_image->process_planar_image(pY, y_stride, pCb, cb_stride, pCr, cr_stride))
+        return false;
+   }
+
+   buf_size = dst_stream.get_size();
+   return true;
+}
+
+growable_memory_stream::growable_memory_stream() : m_pBuf(NULL), m_buf_size(0), m_buf_ofs(0) { }
+
+growable_memory_stream::~growable_memory_stream()
+{
+   jpge_free(m_pBuf);
+}
+
+bool growable_memory_stream::reserve(uint len)
+{
+   if (len > m_buf_size - m_buf_ofs)
+   {
+      uint new_size = JPGE_MAX(m_buf_size * 2, 4096U);
+      while (len > new_size - m_buf_ofs)
+         new_size *= 2;
+      uint8 *pNew_buf = static_cast<uint8*>(jpge_realloc(m_pBuf, new_size));
+      if (!pNew_buf)
+         return false;
+      m_pBuf = pNew_buf;
+      m_buf_size = new_size;
+   }
+   return true;
+}
+
+bool growable_memory_stream::put_buf(const void* pBuf, int len)
+{
+   if (!reserve(len))
+      return false;
+   memcpy(m_pBuf + m_buf_ofs, pBuf, len);
+   m_buf_ofs += len;
+   return true;
+}
+
+uint8 *growable_memory_stream::get_write_window(uint min_len, uint &avail_len)
+{
+   avail_len = 0;
+   if (!reserve(min_len))
+      return NULL;
+   avail_len = m_buf_size - m_buf_ofs;
+   return m_pBuf + m_buf_ofs;
+}
+
+bool growable_memory_stream::commit(uint len)
+{
+   if (len > m_buf_size - m_buf_ofs)
+      return false;
+   m_buf_ofs += len;
+   return true;
+}
+
+uint8 *growable_memory_stream::take_buf()
+{
+   uint8 *pBuf = m_pBuf;
+   if ((pBuf) && (m_buf_ofs < m_buf_size))
+   {
+      uint8 *pShrunk_buf = static_cast<uint8*>(jpge_realloc(pBuf, JPGE_MAX(m_buf_ofs, 1U)));
+      if (pShrunk_buf)
+         pBuf = pShrunk_buf;
+   }
+   m_pBuf = NULL;
+   m_buf_size = m_buf_ofs = 0;
+   return pBuf;
+}
+
+uint8 *compress_image_to_jpeg_file_in_memory_alloc(int &buf_size, const image_desc &image, const params &comp_params)
+{
+   buf_size = 0;
+   if (!image.check())
+      return NULL;
+   if (code_as_grayscale(image, comp_params))
+      return compress_image_to_jpeg_file_in_memory_alloc(buf_size, image, grayscale_params(comp_params));
+
+   growable_memory_stream dst_stream;
+   pooled_encoder dst_image;
+   if (!dst_image->init(&dst_stream, image.m_width, image.m_height, image.m_format, comp_params))
+      return NULL;
+
+   for (uint pass_index = 0; pass_index < dst_image->get_total_passes(); pass_index++)
+   {
+     for (int i = 0; i < image.m_height; i++)
+     {
+        if (!dst_image->process_scanline(image.get_row(i)))
+           return NULL;
+     }
+     if (!dst_image->process_scanline(NULL))
+        return NULL;
+   }
+
+   buf_size = dst_stream.get_size();
+   return dst_stream.take_buf();
+}
+
+// The encoders, output buffers and threads of a strip encode. mjpeg_encoder keeps one for a whole sequence, so after the first frame only
+// the scan data is coded again: the MCU lines, tables, header cache and strip buffers are reused and the threads wait for the next frame.
+struct strip_set
+{
+   jpeg_encoder m_master;
+   jpeg_encoder *m_pStrips;
+   growable_memory_stream *m_pStreams;
+   bool *m_pStatus;
+   uint m_max_strips;
+#if JPGE_USE_THREADS
+   std::thread *m_pThreads;
+   uint m_num_threads;
+   std::mutex m_mutex;
+   std::condition_variable m_work_cond, m_done_cond;
+   void (*m_pJob)(const void *pFunc, uint i);
+   const void *m_pJob_func;
+   uint m_job_strips, m_job_num, m_pending;
+   bool m_quit;
+#endif
+
+   strip_set() : m_pStrips(NULL), m_pStreams(NULL), m_pStatus(NULL), m_max_strips(0)
+   {
+#if JPGE_USE_THREADS
+      m_pThreads = NULL;
+      m_num_threads = 0;
+      m_pJob = NULL;
+      m_pJob_func = NULL;
+      m_job_strips = m_job_num = m_pending = 0;
+      m_quit = false;
+#endif
+   }
+
+   ~strip_set()
+   {
+      stop_threads();
+      delete[] m_pStatus;
+      delete[] m_pStreams;
+      delete[] m_pStrips;
+   }
+
+   void stop_threads()
+   {
+#if JPGE_USE_THREADS
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_quit = true;
+      }
+      m_work_cond.notify_all();
+      for (uint i = 0; i < m_num_threads; i++)
+         m_pThreads[i].join();
+      delete[] m_pThreads;
+      m_pThreads = NULL;
+      m_num_threads = 0;
+      m_quit = false;
+#endif
+   }
+
+   void reserve(uint num_strips)
+   {
+      if (num_strips <= m_max_strips)
+         return;
+      stop_threads();
+      delete[] m_pStatus;
+      delete[] m_pStreams;
+      delete[] m_pStrips;
+      m_pStrips = new jpeg_encoder[num_strips];
+      m_pStreams = new growable_memory_stream[num_strips];
+      m_pStatus = new bool[num_strips];
+      m_max_strips = num_strips;
+#if JPGE_USE_THREADS
+      m_pThreads = new std::thread[num_strips - 1];
+#endif
+   }
+
+#if JPGE_USE_THREADS
+   template<class F> static void call(const void *pFunc, uint i) { (*static_cast<const F*>(pFunc))(i); }
+
+   // Thread i runs strip i of every job that has one, from job number job_num on.
+   void work(uint i, uint job_num)
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      for ( ; ; )
+      {
+         m_work_cond.wait(lock, [&] { return (m_quit) || (m_job_num != job_num); });
+         if (m_quit)
+            return;
+         job_num = m_job_num;
+         if (i >= m_job_strips)
+            continue;
+         lock.unlock();
+         m_pJob(m_pJob_func, i);
+         lock.lock();
+         if (!--m_pending)
+            m_done_cond.notify_one();
+      }
+   }
+#endif
+
+   // Calls func(i) for i in [0, n), on n threads when threading is enabled. The caller's thread runs i = 0, and any strips left without a
+   // thread because one couldn't be created.
+   template<class F> void run(uint n, const F &func)
+   {
+#if JPGE_USE_THREADS
+      if (n > 1)
+      {
+         std::unique_lock<std::mutex> lock(m_mutex);
+         try
+         {
+            for ( ; m_num_threads < n - 1; m_num_threads++)
+               m_pThreads[m_num_threads] = std::thread(&strip_set::work, this, m_num_threads + 1, m_job_num);
+         }
+         catch (const std::system_error &)
+         {
+         }
+         const uint num_threaded = JPGE_MIN(m_num_threads, n - 1);
+         m_pJob = &call<F>;
+         m_pJob_func = &func;
+         m_job_strips = n;
+         m_pending = num_threaded;
+         m_job_num++;
+         lock.unlock();
+         m_work_cond.notify_all();
+         func(0);
+         for (uint i = num_threaded + 1; i < n; i++)
+            func(i);
+         lock.lock();
+         m_done_cond.wait(lock, [&] { return !m_pending; });
+         return;
+      }
+#endif
+      for (uint i = 0; i < n; i++)
+         func(i);
+   }
+};
+
+// The rows [first_row, first_row + num_rows) of an image.
+static image_desc crop_rows(const image_desc &image, int first_row, int num_rows)
+{
+   image_desc rows(image);
+   rows.m_y += first_row;
+   rows.m_height = num_rows;
+   return rows;
+}
+
+bool compress_image_to_jpeg_file_in_memory_mt(void *pDstBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params, int num_threads)
+{
+   return compress_image_to_jpeg_file_in_memory_mt(pDstBuf, buf_size, image_desc(pImage_data, width, height, num_channels), comp_params, num_threads);
+}
+
+// Strips must start at restart markers, so encode_strips() restarts every comp_params.m_restart_interval MCU rows if that's a whole number
+// of rows, and otherwise (or if it's more than the 65535 MCUs DRI can hold) every row.
+static uint get_strip_interval_rows(const params &comp_params, uint mcus_per_row)
+{
+   uint rows = 1;
+   if (comp_params.m_restart_in_rows_flag)
+      rows = JPGE_MAX(comp_params.m_restart_interval, 1U);
+   else if ((comp_params.m_restart_interval) && ((comp_params.m_restart_interval % mcus_per_row) == 0))
+      rows = comp_params.m_restart_interval / mcus_per_row;
+   return (rows > 0xFFFFU / mcus_per_row) ? 1 : rows;
+}
+
+// Writes image to pStream coded as up to num_threads strips split at restart markers, each encoded on its own thread. Not for progressive
+// files. With omit_dht the file has no DHT segments, which requires one pass standard table coding.
+bool jpeg_encoder::encode_strips(strip_set &strips, output_stream *pStream, const image_desc &image, const params &comp_params, int num_threads, bool omit_dht)
+{
+   const int width = image.m_width, height = image.m_height;
+
+   params strip_params(comp_params);
+   const uint mcu_x = (comp_params.m_subsampling >= H2V1) ? 16 : 8, mcu_y = (comp_params.m_subsampling == H2V2) ? 16 : 8;
+   const uint mcus_per_row = (width + mcu_x - 1) / mcu_x, mcu_rows = (height + mcu_y - 1) / mcu_y;
+   const uint interval_rows = get_strip_interval_rows(comp_params, mcus_per_row);
+   strip_params.m_restart_interval = interval_rows;
+   strip_params.m_restart_in_rows_flag = true;
+
+#if JPGE_USE_THREADS
+   if (num_threads <= 0)
+      num_threads = static_cast<int>(std::thread::hardware_concurrency());
+#endif
+   const uint num_intervals = (mcu_rows + interval_rows - 1) / interval_rows;
+   const uint num_strips = JPGE_MIN(static_cast<uint>(JPGE_MAX(num_threads, 1)), num_intervals);
+   jpeg_encoder &master = strips.m_master;
+   master.m_omit_dht_flag = omit_dht;
+   if (num_strips <= 1)
+   {
+      if (!master.init(pStream, width, height, image.m_format, strip_params))
+         return false;
+      for (uint pass_index = 0; pass_index < master.get_total_passes(); pass_index++)
+         if (!master.process_image(image))
+            return false;
+      return true;
+   }
+
+   // The master encoder only writes the headers and EOI; with two passes it also merges the strips' symbol statistics into the final tables.
+   params master_params(strip_params);
+   master_params.m_max_coefficient_buffer_size = 0;
+   if (!master.init(pStream, width, height, image.m_format, master_params))
+      return false;
+
+   strips.reserve(num_strips);
+   jpeg_encoder *pStrips = strips.m_pStrips;
+   growable_memory_stream *pStreams = strips.m_pStreams;
+   bool *pStatus = strips.m_pStatus;
+
+   strips.run(num_strips, [&](uint i) {
+      pStreams[i].clear();
+      const uint first_interval = (i * num_intervals) / num_strips, end_interval = ((i + 1) * num_intervals) / num_strips;
+      const int first_row = first_interval * interval_rows * mcu_y, end_row = JPGE_MIN(static_cast<int>(end_interval * interval_rows * mcu_y), height);
+      pStatus[i] = pStrips[i].init_strip(&pStreams[i], width, end_row - first_row, image.m_format, strip_params, true, first_interval) &&
+                   pStrips[i].process_image(crop_rows(image, first_row, end_row - first_row));
+   });
+
+   bool status = true;
+   for (uint i = 0; i < num_strips; i++)
+      status = status && pStatus[i];
+
+   if ((status) && (strip_params.m_two_pass_flag))
+   {
+      for (uint i = 0; i < num_strips; i++)
+         for (uint t = 0; t < 4; t++)
+            for (uint j = 0; j < 256; j++)
+               master.m_huff_count[t][j] += pStrips[i].m_huff_count[t][j];
+      status = master.terminate_pass_one();
+      if (status)
+      {
+         strips.run(num_strips, [&](uint i) {
+            const uint first_interval = (i * num_intervals) / num_strips;
+            const int first_row = first_interval * interval_rows * mcu_y;
+            pStatus[i] = pStrips[i].begin_strip_pass_two(master) &&
+                         ((pStrips[i].get_cur_pass() > 2) || pStrips[i].process_image(crop_rows(image, first_row, pStrips[i].m_image_y)));
+         });
+         for (uint i = 0; i < num_strips; i++)
+            status = status && pStatus[i];
+      }
+   }
+
+   for (uint i = 0; (status) && (i < num_strips); i++)
+      status = pStream->put_buf(pStreams[i].get_buf(), pStreams[i].get_size());
+   if (status)
+   {
+      master.emit_marker(M_EOI);
+      master.flush_output_buffer();
+      status = master.m_all_stream_writes_succeeded;
+   }
+
+   return status;
+}
+
+bool compress_image_to_jpeg_file_in_memory_mt(void *pDstBuf, int &buf_size, const image_desc &image, const params &comp_params, int num_threads)
+{
+   if ((!pDstBuf) || (!buf_size) || (!image.check()) || (!comp_params.check()))
+      return false;
+   if (code_as_grayscale(image, comp_params))
+      return compress_image_to_jpeg_file_in_memory_mt(pDstBuf, buf_size, image, grayscale_params(comp_params), num_threads);
+
+   // Progressive images are encoded on this thread. The grayscale check has already been made, so it isn't repeated there.
+   if (comp_params.m_progressive_flag)
+   {
+      params single_params(comp_params);
+      single_params.m_auto_grayscale_flag = false;
+      return compress_image_to_jpeg_file_in_memory(pDstBuf, buf_size, image, single_params);
+   }
+
+   memory_stream dst_stream(pDstBuf, buf_size);
+   buf_size = 0;
+   strip_set strips;
+   if (!jpeg_encoder::encode_strips(strips, &dst_stream, image, comp_params, num_threads, false))
+      return false;
+   buf_size = dst_stream.get_size();
+   return true;
+}
+
+uint8 *compress_image_to_jpeg_file_in_memory_mt_alloc(int &buf_size, const image_desc &image, const params &comp_params, int num_threads)
+{
+   buf_size = 0;
+   if ((!image.check()) || (!comp_params.check()))
+      return NULL;
+   if (code_as_grayscale(image, comp_params))
+      return compress_image_to_jpeg_file_in_memory_mt_alloc(buf_size, image, grayscale_params(comp_params), num_threads);
+
+   if (comp_params.m_progressive_flag)
+   {
+      params single_params(comp_params);
+      single_params.m_auto_grayscale_flag = false;
+      return compress_image_to_jpeg_file_in_memory_alloc(buf_size, image, single_params);
+   }
+
+   growable_memory_stream dst_stream;
+   strip_set strips;
+   if (!jpeg_encoder::encode_strips(strips, &dst_stream, image, comp_params, num_threads, false))
+      return NULL;
    buf_size = dst_stream.get_size();
+   return dst_stream.take_buf();
+}
+
+// Stream that only counts the bytes written to it.
+class counting_stream : public output_stream
+{
+   counting_stream(const counting_stream &);
+   counting_stream &operator= (const counting_stream &);
+
+   uint m_size;
+
+public:
+   counting_stream() : m_size(0) { }
+
+   virtual ~counting_stream() { }
+
+   virtual bool put_buf(const void* pBuf, int len)
+   {
+      (void)pBuf;
+      m_size += len;
+      return true;
+   }
+
+   uint get_size() const { return m_size; }
+};
+
+// Makes pass one keep every block's unquantized DCT output (128 bytes per 8x8 block) instead of coding it, so the image can be coded at
+// any quality afterwards without being read again.
+bool jpeg_encoder::init_dct_cache()
+{
+  const uint64 size = get_coefficient_buffer_size();
+  if (size != static_cast<size_t>(size))
+    return false;
+  m_pDCT_cache = static_cast<int16*>(jpge_malloc(static_cast<size_t>(size)));
+  m_num_buffered_blocks = 0;
+  return m_pDCT_cache != NULL;
+}
+
+// Predicts the size of the file coding the DCT cache at the given quality would produce, from the symbol histograms alone. The headers are
+// exact; the entropy coded data is exact but for byte stuffing, which is assumed to hit 1 byte in 256, and restart padding, taken as 7 bits.
+uint jpeg_encoder::estimate_dct_cache_size(int quality)
+{
+  set_quality(quality);
+  clear_obj(m_huff_count);
+  first_pass_init();
+  code_dct_cache<1>();
+
+  counting_stream header_stream;
+  output_stream *pStream = m_pStream;
+  m_pStream = &header_stream;
+  if ((m_params.m_two_pass_flag) || (m_params.m_progressive_flag))
+    terminate_pass_one();
+  else
+  {
+    set_std_huffman_tables();
+    second_pass_init();
+  }
+  m_pStream = pStream;
+
+  uint64 total_bits = 0;
+  for (int t = 0; t < 4; t++)
+    for (int i = 0; i < 256; i++)
+      if (m_huff_count[t][i])
+        total_bits += static_cast<uint64>(m_huff_count[t][i]) * ((m_huff_codes[t][i] & 0xFF) + (i & 15));
+  const uint64 num_mcus = m_num_buffered_blocks / m_blocks_per_mcu;
+  const uint64 num_restarts = m_restart_interval ? ((num_mcus - 1) / m_restart_interval) : 0;
+  const uint64 data_size = (total_bits + 7) / 8;
+  const uint64 size = header_stream.get_size() + data_size + data_size / 256 + num_restarts * 3 + 2;
+  return static_cast<uint>(JPGE_MIN(size, static_cast<uint64>(0xFFFFFFFFU)));
+}
+
+// Writes a complete file coding the DCT cache at the given quality to pStream. With counts_ready, m_huff_count already holds the statistics
+// of the last estimate_dct_cache_size() call, made at this quality.
+bool jpeg_encoder::emit_dct_cache(output_stream *pStream, int quality, bool counts_ready)
+{
+  m_pStream = pStream;
+  m_all_stream_writes_succeeded = true;
+  m_pOut_buf = m_pOut_buf_start = NULL;
+  m_out_buf_left = 0;
+  set_quality(quality);
+
+  if (m_params.m_progressive_flag)
+  {
+    if ((!m_pCoefficient_buffer) && ((m_pCoefficient_buffer = static_cast<int16*>(jpge_malloc(static_cast<size_t>(get_coefficient_buffer_size())))) == NULL))
+      return false;
+    const uint8 *pComponents = s_mcu_components[m_params.m_subsampling];
+    for (uint i = 0; i < m_num_buffered_blocks; i++)
+    {
+      load_quantized_coefficients(pComponents[i % m_blocks_per_mcu], m_pDCT_cache + i * 64);
+      memcpy(m_pCoefficient_buffer + i * 64, m_coefficient_array, sizeof(m_coefficient_array));
+    }
+    return code_progressive_scans();
+  }
+
+  if (m_params.m_two_pass_flag)
+  {
+    if (!counts_ready)
+    {
+      clear_obj(m_huff_count);
+      first_pass_init();
+      code_dct_cache<1>();
+    }
+    terminate_pass_one();
+  }
+  else
+  {
+    set_std_huffman_tables();
+    second_pass_init();
+  }
+  code_dct_cache<2>();
+  terminate_pass_two();
+  return m_all_stream_writes_succeeded;
+}
+
+// The natural log of the factor compute_quant_table() scales the standard tables by (in percent) at a quality, and its inverse.
+static double log_quant_scale(int quality)
+{
+  return log((quality < 50) ? (5000.0 / quality) : JPGE_MAX(200.0 - quality * 2, 1.0));
+}
+
+static int quality_from_log_quant_scale(double x)
+{
+  const double scale = exp(JPGE_MIN(x, 10.0));
+  return static_cast<int>(floor(((scale >= 100) ? (5000.0 / scale) : ((200.0 - scale) * .5)) + .5));
+}
+
+bool compress_image_to_jpeg_file_in_memory_target_size(void *pDstBuf, int &buf_size, int target_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params, int *pQuality)
+{
+   return compress_image_to_jpeg_file_in_memory_target_size(pDstBuf, buf_size, target_size, image_desc(pImage_data, width, height, num_channels), comp_params, pQuality);
+}
+
+bool compress_image_to_jpeg_file_in_memory_target_size(void *pDstBuf, int &buf_size, int target_size, const image_desc &image, const params &comp_params, int *pQuality)
+{
+   if ((!pDstBuf) || (buf_size <= 0) || (target_size <= 0) || (!image.check()))
+      return false;
+   if (code_as_grayscale(image, comp_params))
+      return compress_image_to_jpeg_file_in_memory_target_size(pDstBuf, buf_size, target_size, image, grayscale_params(comp_params), pQuality);
+   const uint max_size = static_cast<uint>(JPGE_MIN(buf_size, target_size));
+   buf_size = 0;
+
+   // Pass one of a two-pass encode writes nothing, so it's used to color convert and transform the image once into the DCT cache.
+   params cache_params(comp_params);
+   cache_params.m_quality = 100;
+   cache_params.m_two_pass_flag = true;
+   cache_params.m_progressive_flag = false;
+   cache_params.m_max_coefficient_buffer_size = 0;
+   if (comp_params.m_progressive_flag)
+      cache_params.m_restart_interval = 0;
+
+   counting_stream null_stream;
+   jpeg_encoder encoder;
+   if ((!encoder.init(&null_stream, image.m_width, image.m_height, image.m_format, cache_params)) || (!encoder.init_dct_cache()) || (!encoder.process_image(image)))
+      return false;
+   encoder.m_params.m_two_pass_flag = comp_params.m_two_pass_flag;
+   encoder.m_params.m_progressive_flag = comp_params.m_progressive_flag;
+
+   // Search for the highest quality whose predicted size fits, between lo (fits, or 0) and hi (too big, or 101). The log of the file size is
+   // close to linear in the log of the quantization scale, so each guess extrapolates along the line through the last two estimates (the
+   // first along a typical slope), with a bisection whenever two guesses in a row fail to halve a measured range.
+   const double log_max_size = log(static_cast<double>(max_size));
+   int lo = 0, hi = 101, quality = 75, last_quality = 0;
+   double last_x = 0, last_y = 0;
+   int slow_steps = 0;
+   while (hi - lo > 1)
+   {
+      const int range = ((lo) && (hi <= 100)) ? (hi - lo) : 1000;
+      const uint size = encoder.estimate_dct_cache_size(quality);
+      if (size <= max_size)
+         lo = quality;
+      else
+         hi = quality;
+      const double x = log_quant_scale(quality), y = log(static_cast<double>(JPGE_MAX(size, 1U)));
+      double slope = -.5;
+      if ((last_quality) && (x != last_x) && ((y - last_y) / (x - last_x) < -.05))
+         slope = (y - last_y) / (x - last_x);
+      last_quality = quality; last_x = x; last_y = y;
+      slow_steps = ((hi - lo) * 2 > range) ? (slow_steps + 1) : 0;
+      quality = (slow_steps >= 2) ? ((lo + hi + 1) / 2) : quality_from_log_quant_scale(x + (log_max_size - y) / slope);
+      quality = JPGE_MAX(lo + 1, JPGE_MIN(quality, hi - 1));
+      if (slow_steps >= 2)
+         slow_steps = 0;
+   }
+
+   // The prediction is close but not a bound, so step down until the real file fits.
+   const int first_quality = JPGE_MAX(lo, 1);
+   for (quality = first_quality; quality >= 1; quality--)
+   {
+      memory_stream dst_stream(pDstBuf, max_size);
+      if (encoder.emit_dct_cache(&dst_stream, quality, quality == last_quality))
+      {
+         buf_size = dst_stream.get_size();
+         break;
+      }
+   }
+   if (quality < 1)
+      return false;
+
+   // It usually runs high, though: stuffing is taken as 1 byte in 256, and progressive files are predicted from baseline statistics. So
+   // if the first quality tried fits, the real files above it are coded into a scratch buffer until one doesn't.
+   if ((quality == first_quality) && (quality < 100))
+   {
+      uint8 *pScratch = static_cast<uint8*>(jpge_malloc(max_size));
+      while ((pScratch) && (quality < 100))
+      {
+         memory_stream scratch_stream(pScratch, max_size);
+         if (!encoder.emit_dct_cache(&scratch_stream, quality + 1, false))
+            break;
+         quality++;
+         buf_size = scratch_stream.get_size();
+         memcpy(pDstBuf, pScratch, buf_size);
+      }
+      jpge_free(pScratch);
+   }
+   if (pQuality)
+      *pQuality = quality;
    return true;
 }
 
+// Worst case bits of a code, counting its 1s twice: a run of eight 1s may come out as an 0xFF byte and need a stuffed 0 byte, and every
+// Huffman code has at least one 0 (the all ones code is never assigned). Optimized codes are limited to 16 bits, and a DC table has at most
+// 13 symbols (the 12 categories and the reserved code), so its codes are at most 12 bits.
+static uint code_cost(const uint *pCodes, uint sym, bool optimized, bool ac)
+{
+  if (optimized)
+    return ac ? (16 + 15) : (12 + 11);
+  uint cost = pCodes[sym] & 0xFF;
+  for (uint code = pCodes[sym] >> 8; code; code &= code - 1)
+    cost++;
+  return cost;
+}
+
+// An upper bound on the file size: each block's costliest mix of symbols and magnitudes that the energy of 64 pixels allows, a stuffed zero
+// for every eight bits that can be 1s, and padding at the end of every scan or restart interval, serial or strip parallel. The headers are measured, plus the largest
+// tables optimization or the progressive scans can add.
+uint64 jpeg_encoder::get_size_bound()
+{
+  // |F(u,v)| <= 128 / 4 * C(u) * C(v) * sum|cos((2x+1)u*pi/16)| * sum|cos((2y+1)v*pi/16)|; 2 more absorbs the integer DCT's rounding.
+  double sums[8];
+  for (int u = 0; u < 8; u++)
+  {
+    sums[u] = 0;
+    for (int x = 0; x < 8; x++)
+      sums[u] += fabs(cos((2 * x + 1) * u * 3.14159265358979323846 / 16)) * (u ? 1.0 : sqrt(.5));
+  }
+
+  counting_stream header_stream;
+  output_stream *pStream = m_pStream;
+  m_pStream = &header_stream;
+  emit_markers();
+  m_pStream = pStream;
+
+  const bool optimized = (m_params.m_two_pass_flag) || (m_params.m_progressive_flag);
+  const progressive_scan *pScans = (m_num_components == 3) ? s_ycc_scans : s_grey_scans;
+  const int num_scans = !m_params.m_progressive_flag ? 0 : ((m_num_components == 3) ? (int)(sizeof(s_ycc_scans) / sizeof(s_ycc_scans[0])) : (int)(sizeof(s_grey_scans) / sizeof(s_grey_scans[0])));
+  const uint64 num_mcus = static_cast<uint64>(m_mcus_per_row) * (m_image_y_mcu / m_mcu_y);
+  // Costs below are bits plus the number of them that can be 1s, so a segment of n bits costs up to n / 8 bytes and n / 8 stuffed bytes.
+  // Magnitude bits may all be 1s and cost 2 each.
+  uint64 total_cost = 0;
+  for (int c = 0; c < m_num_components; c++)
+  {
+    const int t = (c > 0);
+    // energy[k][b]: the least energy of an AC coefficient at zigzag position k that quantizes to category b, |F| >= 2^(b-1) * q - q/2 - 2.
+    uint cat[64], al[64];
+    int64 energy[64][16];
+    for (int k = 0; k < 64; k++)
+    {
+      const int n = s_zag[k];
+      cat[k] = bit_length(static_cast<uint>(128 / 4 * sums[n & 7] * sums[n >> 3] + 2) / m_quantization_tables[t][k] + 1);
+      al[k] = 0;
+      for (uint b = 0; b <= cat[k]; b++)
+      {
+        const int64 q = m_quantization_tables[t][k], f = b ? JPGE_MAX((q << (b - 1)) - (q >> 1) - 2, (int64)0) : 0;
+        energy[k][b] = f * f;
+      }
+    }
+
+    // Costs that don't depend on the coefficients' magnitudes: the DC coefficient, and in progressive mode each scan's symbols.
+    uint fixed_cost = 0;
+    for (uint a = 0; (!m_params.m_progressive_flag) && (a <= JPGE_MIN(cat[0] + 1, 11U)); a++)
+      fixed_cost = JPGE_MAX(fixed_cost, code_cost(m_huff_codes[0 + t], a, optimized, false) + a * 2);
+    uint sym_cost[16][16];
+    for (uint r = 0; r < 16; r++)
+      for (uint a = 1; a < 16; a++)
+        sym_cost[r][a] = code_cost(m_huff_codes[2 + t], (r << 4) + a, optimized, true) + a * 2;
+    const uint zrl_cost = code_cost(m_huff_codes[2 + t], 0xF0, optimized, true), eob_cost = code_cost(m_huff_codes[2 + t], 0, optimized, true);
+    for (int i = 0; i < num_scans; i++)
+    {
+      const progressive_scan &scan = pScans[i];
+      if ((scan.m_comps[0] != c) && ((scan.m_num_comps < 2) || ((scan.m_comps[1] != c) && (scan.m_comps[2] != c))))
+        continue;
+      if (!scan.m_ss)
+        fixed_cost += scan.m_ah ? 2 : (code_cost(NULL, 0, true, false) + (cat[0] + 1 - JPGE_MIN(cat[0] + 1, (uint)scan.m_al)) * 2);
+      else
+      {
+        // A coefficient gets a symbol in the scan where it becomes nonzero, and otherwise a refinement adds just a correction or sign bit.
+        // An EOB run costs a symbol and 14 bits.
+        const uint ac_cost = code_cost(NULL, 0, true, true);
+        for (int k = scan.m_ss; k <= scan.m_se; k++)
+        {
+          fixed_cost += scan.m_ah ? 2 : ac_cost;
+          if (!scan.m_ah)
+            al[k] = JPGE_MIN((uint)scan.m_al, cat[k]);
+        }
+        fixed_cost += ac_cost + 14 * 2;
+      }
+    }
+
+    // The DCT is orthonormal, so a block's coefficients have at most 64 * 128^2 of energy. For any lambda >= 0 the most a block can cost
+    // is at most lambda * 64 * 128^2 plus the most that cost - lambda * energy can be, which is found by trying every category at every
+    // position, and every mix of runs (with ZRLs and an EOB) in baseline mode. The smallest of these bounds over a range of lambdas is used.
+    // Values are scaled by 2^(s+1) for lambda = m / 2^(s+1), so the arithmetic is exact.
+    uint64 block_cost = 0;
+    for (int s = -1; s <= 36; s++)
+    {
+      for (int m = 2; m <= 3; m++)
+      {
+        const int shift = JPGE_MAX(s + 1, 0);
+        const int64 lambda = (s < 0) ? 0 : m;
+        int64 value = 0;
+        if (!m_params.m_progressive_flag)
+        {
+          // best[k]: the most for positions 1..k with k the last nonzero one.
+          int64 best[64];
+          best[0] = 0;
+          value = eob_cost << shift;
+          for (int k = 1; k < 64; k++)
+          {
+            int64 coeff_value[16];
+            for (uint r = 0; r < 16; r++)
+            {
+              coeff_value[r] = ((int64)sym_cost[r][1] << shift) - lambda * energy[k][1];
+              for (uint a = 2; a <= JPGE_MIN(cat[k], 15U); a++)
+                coeff_value[r] = JPGE_MAX(coeff_value[r], ((int64)sym_cost[r][a] << shift) - lambda * energy[k][a]);
+            }
+            best[k] = ((int64)(((k - 1) >> 4) * zrl_cost) << shift) + coeff_value[(k - 1) & 15];
+            for (int j = 1; j < k; j++)
+            {
+              const int run = k - j - 1;
+              best[k] = JPGE_MAX(best[k], best[j] + ((int64)((run >> 4) * zrl_cost) << shift) + coeff_value[run & 15]);
+            }
+            value = JPGE_MAX(value, best[k] + ((k < 63) ? ((int64)eob_cost << shift) : 0));
+          }
+        }
+        else
+        {
+          for (int k = 1; k < 64; k++)
+          {
+            int64 coeff_value = 0;
+            for (uint b = al[k] + 1; b <= cat[k]; b++)
+              coeff_value = JPGE_MAX(coeff_value, ((int64)((b - al[k]) * 2) << shift) - lambda * energy[k][b]);
+            value += coeff_value;
+          }
+        }
+        value += lambda * (64 * 128 * 128);
+        const uint64 cost = fixed_cost + ((static_cast<uint64>(value) + (1ULL << shift) - 1) >> shift);
+        block_cost = (s < 0) ? cost : JPGE_MIN(block_cost, cost);
+        if (s < 0)
+          break;
+      }
+    }
+
+    total_cost += block_cost * num_mcus * (c ? 1 : (m_comp_h_samp[0] * m_comp_v_samp[0]));
+  }
+
+  // Each segment (scan or restart interval) ends with up to seven 1s of padding. The _mt functions may restart more often than m_params asks.
+  uint64 num_restarts = m_restart_interval ? ((num_mcus - 1) / m_restart_interval) : 0;
+  if (!m_params.m_progressive_flag)
+    num_restarts = JPGE_MAX(num_restarts, static_cast<uint64>((m_image_y_mcu / m_mcu_y - 1) / get_strip_interval_rows(m_params, m_mcus_per_row)));
+  total_cost += (JPGE_MAX(num_scans, 1) + num_restarts) * 7 * 2;
+
+  uint64 size = header_stream.get_size() + total_cost / 8 + num_restarts * 2 + 2;
+  if (optimized)
+    size += (2 + 2 + 1 + 16 + AC_LUM_CODES) * 2 * (num_scans + 1) + (2 + 2 + 1 + 2 * 3 + 3 + 1) * num_scans;
+  return size;
+}
+
+uint64 get_compressed_size_bound(int width, int height, const params &comp_params)
+{
+   // Sized in baseline mode, which needs no coefficient buffer, then switched back.
+   params baseline_params(comp_params);
+   baseline_params.m_two_pass_flag = false;
+   baseline_params.m_progressive_flag = false;
+   if (comp_params.m_progressive_flag)
+      baseline_params.m_restart_interval = 0;
+   counting_stream null_stream;
+   jpeg_encoder encoder;
+   bool status = encoder.init(&null_stream, width, height, PIXEL_RGB, baseline_params);
+   if ((!status) && (baseline_params.m_restart_in_rows_flag))
+   {
+      // A row interval too long for DRI fails a serial encode, but the _mt functions restart every row instead.
+      baseline_params.m_restart_interval = 0;
+      status = encoder.init(&null_stream, width, height, PIXEL_RGB, baseline_params);
+   }
+   if (!status)
+      return 0;
+   encoder.m_params.m_two_pass_flag = comp_params.m_two_pass_flag;
+   encoder.m_params.m_progressive_flag = comp_params.m_progressive_flag;
+   return encoder.get_size_bound();
+}
+
+mjpeg_encoder::mjpeg_encoder() : m_pStream(NULL), m_width(0), m_height(0), m_pixel_format(PIXEL_RGB), m_part_header_len(0), m_num_frames(0), m_num_threads(1), m_pStrip_set(NULL)
+{
+  m_part_header[0] = '\0';
+  m_part_stream.m_pStream = NULL;
+  m_part_stream.m_pHeader = m_part_header;
+  m_part_stream.m_header_len = 0;
+}
+
+mjpeg_encoder::~mjpeg_encoder()
+{
+  delete m_pStrip_set;
+}
+
+bool mjpeg_encoder::init(output_stream *pStream, int width, int height, pixel_format_t pixel_format, const params &comp_params, container_t container, const char *pBoundary, bool omit_dht, int num_threads)
+{
+  m_pStream = NULL;
+  m_num_frames = 0;
+  m_part_header_len = 0;
+  if ((!pStream) || (width < 1) || (height < 1) || ((uint)pixel_format > (uint)PIXEL_BGRX) || (!comp_params.check()))
+    return false;
+  // Without DHT the decoder falls back to the standard tables, so the frames must be coded with them.
+  if ((omit_dht) && ((comp_params.m_two_pass_flag) || (comp_params.m_progressive_flag)))
+    return false;
+  if (container == MJPEG_MULTIPART)
+  {
+    // RFC 2046 boundaries are at most 70 characters.
+    if ((!pBoundary) || (!*pBoundary) || (strlen(pBoundary) > 70))
+      return false;
+    m_part_header_len = static_cast<uint>(snprintf(m_part_header, sizeof(m_part_header), "--%s\r\nContent-Type: image/jpeg\r\n\r\n", pBoundary));
+  }
+  m_pStream = pStream;
+  m_width = width;
+  m_height = height;
+  m_pixel_format = pixel_format;
+  m_params = comp_params;
+  m_encoder.m_omit_dht_flag = omit_dht;
+  m_num_threads = comp_params.m_progressive_flag ? 1 : num_threads;
+  return true;
+}
+
+bool mjpeg_encoder::part_stream::put_header()
+{
+  const uint len = m_header_len;
+  m_header_len = 0;
+  return (!len) || m_pStream->put_buf(m_pHeader, len);
+}
+
+bool mjpeg_encoder::part_stream::put_buf(const void *pBuf, int len)
+{
+  return put_header() && m_pStream->put_buf(pBuf, len);
+}
+
+uint8 *mjpeg_encoder::part_stream::get_write_window(uint min_len, uint &avail_len)
+{
+  avail_len = 0;
+  return put_header() ? m_pStream->get_write_window(min_len, avail_len) : NULL;
+}
+
+bool mjpeg_encoder::part_stream::commit(uint len)
+{
+  return m_pStream->commit(len);
+}
+
+bool mjpeg_encoder::begin_frame(bool init_encoder)
+{
+  if (!m_pStream)
+    return false;
+  m_part_stream.m_pStream = m_pStream;
+  m_part_stream.m_pHeader = m_part_header;
+  m_part_stream.m_header_len = m_part_header_len;
+  return (!init_encoder) || m_encoder.init(&m_part_stream, m_width, m_height, m_pixel_format, m_params);
+}
+
+bool mjpeg_encoder::end_frame(bool status)
+{
+  if ((status) && (m_part_header_len))
+    status = m_pStream->put_buf("\r\n", 2);
+  if (status)
+    m_num_frames++;
+  return status;
+}
+
+bool mjpeg_encoder::encode_frame(const void *pPixels, int stride)
+{
+  const image_desc frame(pPixels, m_pixel_format, stride, 0, 0, m_width, m_height);
+  if ((!frame.check()) || (!begin_frame(m_num_threads == 1)))
+    return false;
+  if (m_num_threads != 1)
+  {
+    if (!m_pStrip_set)
+      m_pStrip_set = new strip_set;
+    return end_frame(jpeg_encoder::encode_strips(*m_pStrip_set, &m_part_stream, frame, m_params, m_num_threads, m_encoder.m_omit_dht_flag));
+  }
+  bool status = true;
+  for (uint pass = 0; (status) && (pass < m_encoder.get_total_passes()); pass++)
+    status = m_encoder.process_image(frame);
+  return end_frame(status);
+}
+
+bool mjpeg_encoder::encode_planar_frame(const uint8 *pY, int y_stride, const uint8 *pCb, int cb_stride, const uint8 *pCr, int cr_stride)
+{
+  if (!begin_frame(true))
+    return false;
+  bool status = true;
+  for (uint pass = 0; (status) && (pass < m_encoder.get_total_passes()); pass++)
+    status = m_encoder.process_planar_image(pY, y_stride, pCb, cb_stride, pCr, cr_stride);
+  return end_frame(status);
+}
+
+bool mjpeg_encoder::finish()
+{
+  if (!m_pStream)
+    return false;
+  bool status = true;
+  if (m_part_header_len)
+  {
+    // The closing delimiter is the part header's "--boundary" line with "--" appended.
+    const char *pEnd = strchr(m_part_header, '\r');
+    status = m_pStream->put_buf(m_part_header, static_cast<int>(pEnd - m_part_header)) && m_pStream->put_buf("--\r\n", 4);
+  }
+  m_pStream = NULL;
+  return status;
+}
+
+// Averages 2x2 blocks of two rows of src_width pixels of bpp bytes, channel by channel. An odd last column is averaged with itself.
+static void downsample_rows(uint8 *pDst, const uint8 *pSrc0, const uint8 *pSrc1, int src_width, int bpp)
+{
+  const int dst_width = (src_width + 1) >> 1, even_width = src_width >> 1;
+  for (int x = 0; x < even_width; x++, pDst += bpp, pSrc0 += bpp * 2, pSrc1 += bpp * 2)
+    for (int c = 0; c < bpp; c++)
+      pDst[c] = static_cast<uint8>((pSrc0[c] + pSrc0[c + bpp] + pSrc1[c] + pSrc1[c + bpp] + 2) >> 2);
+  if (dst_width > even_width)
+    for (int c = 0; c < bpp; c++)
+      pDst[c] = static_cast<uint8>((pSrc0[c] + pSrc1[c] + 1) >> 1);
+}
+
+// The levels of compress_image_pyramid(). Level i + 1 keeps the first row of each pair of level i rows in m_pPending until the second arrives.
+struct pyramid_levels
+{
+  int m_num_levels, m_bpp, m_pass;
+  jpeg_encoder *m_pEncoders[JPGE_MAX_PYRAMID_LEVELS];
+  int m_width[JPGE_MAX_PYRAMID_LEVELS];
+  uint8 *m_pPending[JPGE_MAX_PYRAMID_LEVELS], *m_pRow[JPGE_MAX_PYRAMID_LEVELS];
+  bool m_has_pending[JPGE_MAX_PYRAMID_LEVELS];
+  bool m_status;
+
+  // Hands a row of level i to its encoder, then cascades it down as far as it completes a pair.
+  void add_row(int i, const uint8 *pRow)
+  {
+    for ( ; ; )
+    {
+      if (m_pass < static_cast<int>(m_pEncoders[i]->get_total_passes()))
+        m_status = m_status && m_pEncoders[i]->process_scanline(pRow);
+      if (++i == m_num_levels)
+        return;
+      if (!m_has_pending[i])
+      {
+        memcpy(m_pPending[i], pRow, m_width[i - 1] * m_bpp);
+        m_has_pending[i] = true;
+        return;
+      }
+      downsample_rows(m_pRow[i], m_pPending[i], pRow, m_width[i - 1], m_bpp);
+      m_has_pending[i] = false;
+      pRow = m_pRow[i];
+    }
+  }
+
+  // An odd last row is averaged with itself. Flushing in level order also completes the rows this produces further down.
+  void end_pass()
+  {
+    for (int i = 1; i < m_num_levels; i++)
+    {
+      if (!m_has_pending[i])
+        continue;
+      m_has_pending[i] = false;
+      downsample_rows(m_pRow[i], m_pPending[i], m_pPending[i], m_width[i - 1], m_bpp);
+      add_row(i, m_pRow[i]);
+    }
+    for (int i = 0; i < m_num_levels; i++)
+      if (m_pass < static_cast<int>(m_pEncoders[i]->get_total_passes()))
+        m_status = m_status && m_pEncoders[i]->process_scanline(NULL);
+  }
+};
+
+bool compress_image_pyramid(output_stream *const *ppStreams, int num_levels, const image_desc &image, const params &comp_params)
+{
+  if ((!ppStreams) || (num_levels < 1) || (num_levels > JPGE_MAX_PYRAMID_LEVELS) || (!image.check()))
+    return false;
+  for (int i = 0; i < num_levels; i++)
+    if (!ppStreams[i])
+      return false;
+  if (code_as_grayscale(image, comp_params))
+    return compress_image_pyramid(ppStreams, num_levels, image, grayscale_params(comp_params));
+
+  pyramid_levels levels;
+  levels.m_num_levels = num_levels;
+  levels.m_bpp = s_bytes_per_pixel[image.m_format];
+  levels.m_status = true;
+  uint buf_size = 0;
+  for (int i = 0, height = image.m_height; i < num_levels; i++, height = (height + 1) >> 1)
+  {
+    levels.m_width[i] = i ? ((levels.m_width[i - 1] + 1) >> 1) : image.m_width;
+    levels.m_has_pending[i] = false;
+    levels.m_pEncoders[i] = borrow_encoder();
+    levels.m_status = levels.m_status && levels.m_pEncoders[i]->init(ppStreams[i], levels.m_width[i], height, image.m_format, comp_params);
+    if (i)
+      buf_size += (levels.m_width[i - 1] + levels.m_width[i]) * levels.m_bpp;
+  }
+
+  uint8 *pBuf = static_cast<uint8*>(jpge_malloc(JPGE_MAX(buf_size, 1U)));
+  levels.m_status = levels.m_status && (pBuf != NULL);
+  if (levels.m_status)
+  {
+    uint8 *p = pBuf;
+    for (int i = 1; i < num_levels; i++)
+    {
+      levels.m_pPending[i] = p; p += levels.m_width[i - 1] * levels.m_bpp;
+      levels.m_pRow[i] = p; p += levels.m_width[i] * levels.m_bpp;
+    }
+
+    // Every level is fed from the same read of the source, again for each pass an encoder without a coefficient buffer needs.
+    uint num_passes = 0;
+    for (int i = 0; i < num_levels; i++)
+      num_passes = JPGE_MAX(num_passes, levels.m_pEncoders[i]->get_total_passes());
+    for (levels.m_pass = 0; (levels.m_status) && (levels.m_pass < static_cast<int>(num_passes)); levels.m_pass++)
+    {
+      for (int y = 0; (levels.m_status) && (y < image.m_height); y++)
+        levels.add_row(0, image.get_row(y));
+      if (levels.m_status)
+        levels.end_pass();
+    }
+  }
+
+  jpge_free(pBuf);
+  for (int i = 0; i < num_levels; i++)
+    return_encoder(levels.m_pEncoders[i]);
+  return levels.m_status;
+}
+
 }